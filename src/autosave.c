@@ -0,0 +1,187 @@
+/*
+ * TamaTool - A cross-platform Tamagotchi P1 explorer
+ *
+ * Copyright (C) 2021 Jean-Christophe Rona <jc@rona.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "SDL.h"
+
+#include "autosave.h"
+#include "state.h"
+
+#define AUTOSAVE_QUEUE_SIZE		8 // Saves waiting to be written, beyond which requests block
+
+typedef struct {
+	state_snapshot_t snap;
+	uint64_t ticks; // Emulated time of the snapshot
+	bool_t periodic;
+} save_job_t;
+
+/* The emulation thread only copies the state into the queue, while the
+ * worker thread encodes and writes the first job, which stays queued until
+ * it is written. Every requested save is written, except for a periodic
+ * one still waiting when another periodic one is requested: it is simply
+ * replaced.
+ */
+static save_job_t jobs[AUTOSAVE_QUEUE_SIZE];
+static uint32_t job_first = 0;
+static uint32_t job_num = 0;
+static bool_t is_saving = 0;
+static bool_t quit = 0;
+
+static SDL_Thread *worker = NULL;
+static SDL_mutex *lock = NULL;
+static SDL_cond *work_cond = NULL;
+static SDL_cond *idle_cond = NULL;
+
+
+static int worker_thread(void *data)
+{
+	save_job_t *job;
+
+	SDL_LockMutex(lock);
+
+	for (;;) {
+		while (job_num == 0 && !quit) {
+			SDL_CondWait(work_cond, lock);
+		}
+
+		if (job_num == 0) {
+			break;
+		}
+
+		job = &jobs[job_first];
+		is_saving = 1;
+
+		SDL_UnlockMutex(lock);
+		state_save_next(&(job->snap), job->ticks);
+		SDL_LockMutex(lock);
+
+		is_saving = 0;
+		job_first = (job_first + 1) % AUTOSAVE_QUEUE_SIZE;
+		job_num--;
+		SDL_CondBroadcast(idle_cond);
+	}
+
+	SDL_UnlockMutex(lock);
+
+	return 0;
+}
+
+bool_t autosave_start(void)
+{
+	lock = SDL_CreateMutex();
+	work_cond = SDL_CreateCond();
+	idle_cond = SDL_CreateCond();
+	if (lock == NULL || work_cond == NULL || idle_cond == NULL) {
+		fprintf(stderr, "FATAL: Cannot create the autosave synchronization: %s !\n", SDL_GetError());
+		autosave_stop();
+		return 1;
+	}
+
+	quit = 0;
+	worker = SDL_CreateThread(&worker_thread, "autosave", NULL);
+	if (worker == NULL) {
+		fprintf(stderr, "FATAL: Cannot create the autosave thread: %s !\n", SDL_GetError());
+		autosave_stop();
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Saves the current state to the next slot, ticks being the emulated time
+ * since the start. Only the copy of the state is done by the caller, unless
+ * the worker is not running. A periodic save may be replaced by the next
+ * one if not written in the meantime, others are always written.
+ */
+void autosave_request(uint64_t ticks, bool_t periodic)
+{
+	save_job_t *job;
+
+	if (worker == NULL) {
+		state_capture(&(jobs[0].snap));
+		state_save_next(&(jobs[0].snap), ticks);
+		return;
+	}
+
+	SDL_LockMutex(lock);
+
+	job = &jobs[(job_first + job_num + AUTOSAVE_QUEUE_SIZE - 1) % AUTOSAVE_QUEUE_SIZE];
+	if (!periodic || job_num == 0 || (job_num == 1 && is_saving) || !job->periodic) {
+		/* The emulation waits rather than dropping a save */
+		while (job_num == AUTOSAVE_QUEUE_SIZE) {
+			SDL_CondWait(idle_cond, lock);
+		}
+
+		job = &jobs[(job_first + job_num) % AUTOSAVE_QUEUE_SIZE];
+		job_num++;
+	}
+
+	state_capture(&(job->snap));
+	job->ticks = ticks;
+	job->periodic = periodic;
+
+	SDL_CondSignal(work_cond);
+	SDL_UnlockMutex(lock);
+}
+
+/* Waits for the requested saves to be written */
+void autosave_flush(void)
+{
+	if (worker == NULL) {
+		return;
+	}
+
+	SDL_LockMutex(lock);
+	while (job_num > 0) {
+		SDL_CondWait(idle_cond, lock);
+	}
+	SDL_UnlockMutex(lock);
+}
+
+/* Writes what is pending, and stops the worker */
+void autosave_stop(void)
+{
+	if (worker != NULL) {
+		SDL_LockMutex(lock);
+		quit = 1;
+		SDL_CondSignal(work_cond);
+		SDL_UnlockMutex(lock);
+
+		SDL_WaitThread(worker, NULL);
+		worker = NULL;
+	}
+
+	if (idle_cond != NULL) {
+		SDL_DestroyCond(idle_cond);
+		idle_cond = NULL;
+	}
+
+	if (work_cond != NULL) {
+		SDL_DestroyCond(work_cond);
+		work_cond = NULL;
+	}
+
+	if (lock != NULL) {
+		SDL_DestroyMutex(lock);
+		lock = NULL;
+	}
+}
@@ -0,0 +1,152 @@
+/*
+ * TamaTool - A cross-platform Tamagotchi P1 explorer
+ *
+ * Copyright (C) 2021 Jean-Christophe Rona <jc@rona.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "SDL.h"
+
+#include "buzzer.h"
+
+/* Uncomment this line to smooth the square wave edges (polyBLEP),
+ * removing most of the aliasing at the cost of a per-sample loop.
+ */
+//#define BUZZER_BANDLIMITED
+
+#define PHASE_HALF			0x80000000UL
+
+
+void buzzer_init(buzzer_t *bz, uint32_t sample_rate)
+{
+	bz->sample_rate = sample_rate;
+	bz->phase = 0;
+	bz->phase_inc = 0;
+	bz->playing = 0;
+}
+
+/* freq is in dHz */
+void buzzer_set_frequency(buzzer_t *bz, u32_t freq)
+{
+	uint32_t phase_inc = (uint32_t) (((uint64_t) freq << 32) / ((uint64_t) bz->sample_rate * 10));
+
+	if (bz->phase_inc != phase_inc) {
+		bz->phase_inc = phase_inc;
+		bz->phase = 0;
+	}
+}
+
+void buzzer_play(buzzer_t *bz, bool_t en)
+{
+	bz->playing = en;
+	if (!en) {
+		bz->phase = 0;
+	}
+}
+
+void buzzer_apply(buzzer_t *bz, const buzzer_event_t *ev)
+{
+	switch (ev->type) {
+		case BUZZER_EVENT_FREQUENCY:
+			buzzer_set_frequency(bz, ev->value);
+			break;
+
+		case BUZZER_EVENT_PLAY:
+			buzzer_play(bz, ev->value);
+			break;
+	}
+}
+
+static void fill_constant(float *samples, uint32_t num, float value)
+{
+	Uint32 bits;
+
+	memcpy(&bits, &value, sizeof(bits));
+	SDL_memset4(samples, bits, num);
+}
+
+#ifdef BUZZER_BANDLIMITED
+/* Polynomial approximation of the band-limited step residual,
+ * t and dt being normalized to the period
+ */
+static float poly_blep(float t, float dt)
+{
+	if (t < dt) {
+		t /= dt;
+		return t + t - t * t - 1.0f;
+	} else if (t > 1.0f - dt) {
+		t = (t - 1.0f) / dt;
+		return t * t + t + t + 1.0f;
+	}
+
+	return 0.0f;
+}
+#endif
+
+void buzzer_fill(buzzer_t *bz, float *samples, uint32_t num, float volume)
+{
+#ifdef BUZZER_BANDLIMITED
+	float t, dt;
+	uint32_t i;
+#else
+	uint64_t remaining;
+	uint32_t run;
+#endif
+
+	if (!bz->playing || bz->phase_inc == 0) {
+		fill_constant(samples, num, 0.0f);
+		return;
+	}
+
+#ifdef BUZZER_BANDLIMITED
+	dt = (float) bz->phase_inc / 4294967296.0f;
+	for (i = 0; i < num; i++) {
+		t = (float) bz->phase / 4294967296.0f;
+		samples[i] = (bz->phase < PHASE_HALF) ? volume : -volume;
+		samples[i] += volume * poly_blep(t, dt);
+		t += 0.5f;
+		if (t >= 1.0f) {
+			t -= 1.0f;
+		}
+		samples[i] -= volume * poly_blep(t, dt);
+		bz->phase += bz->phase_inc;
+	}
+#else
+	/* The output is constant between two edges, so it is filled one
+	 * half-period (run) at a time
+	 */
+	while (num > 0) {
+		if (bz->phase < PHASE_HALF) {
+			remaining = PHASE_HALF - bz->phase;
+		} else {
+			remaining = ((uint64_t) 1 << 32) - bz->phase;
+		}
+
+		run = (remaining + bz->phase_inc - 1) / bz->phase_inc;
+		if (run > num) {
+			run = num;
+		}
+
+		fill_constant(samples, run, (bz->phase < PHASE_HALF) ? volume : -volume);
+
+		bz->phase += run * bz->phase_inc;
+		samples += run;
+		num -= run;
+	}
+#endif
+}
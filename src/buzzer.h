@@ -0,0 +1,52 @@
+/*
+ * TamaTool - A cross-platform Tamagotchi P1 explorer
+ *
+ * Copyright (C) 2021 Jean-Christophe Rona <jc@rona.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#ifndef _BUZZER_H_
+#define _BUZZER_H_
+
+#include "hal_types.h"
+
+/* Square wave oscillator driven by a 32-bit phase accumulator */
+typedef struct {
+	uint32_t sample_rate;
+	uint32_t phase;
+	uint32_t phase_inc;
+	bool_t playing;
+} buzzer_t;
+
+typedef enum {
+	BUZZER_EVENT_FREQUENCY,
+	BUZZER_EVENT_PLAY,
+} buzzer_event_type_t;
+
+/* Buzzer change, timestamped in emulated time (ticks) */
+typedef struct {
+	u32_t tick;
+	buzzer_event_type_t type;
+	u32_t value;
+} buzzer_event_t;
+
+
+void buzzer_init(buzzer_t *bz, uint32_t sample_rate);
+void buzzer_set_frequency(buzzer_t *bz, u32_t freq);
+void buzzer_play(buzzer_t *bz, bool_t en);
+void buzzer_apply(buzzer_t *bz, const buzzer_event_t *ev);
+void buzzer_fill(buzzer_t *bz, float *samples, uint32_t num, float volume);
+
+#endif /* _BUZZER_H_ */
@@ -3,6 +3,6 @@ TARGET = tamatool
 LIB_FOLDER = lib
 LIB_SRCS = $(LIB_FOLDER)/tamalib.c $(LIB_FOLDER)/cpu.c $(LIB_FOLDER)/hw.c
 
-SRCS = tamatool.c program.c image.c state.c mem_edit.c
+SRCS = tamatool.c program.c image.c state.c mem_edit.c lcd.c record.c crc32.c lockfree.c grid.c buzzer.c wav.c rewind.c autosave.c diff.c convert.c store.c live.c trace.c heatmap.c watch.c shadow.c
 SRCS += $(LIB_SRCS)
 OBJECTS = $(SRCS:.c=.o)
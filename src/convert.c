@@ -0,0 +1,233 @@
+/*
+ * TamaTool - A cross-platform Tamagotchi P1 explorer
+ *
+ * Copyright (C) 2021 Jean-Christophe Rona <jc@rona.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "SDL.h"
+
+#include "convert.h"
+#include "state.h"
+
+#define CONVERT_MAX_THREADS		64
+
+typedef struct {
+	char *name;
+	uint64_t size;
+	bool_t failed;
+} job_t;
+
+typedef struct {
+	char *src_dir;
+	char *dst_dir;
+	bool_t small;
+	job_t *jobs;
+	uint32_t num;
+	SDL_atomic_t next;
+} pool_t;
+
+
+static bool_t join_path(char *path, size_t size, char *dir, char *name)
+{
+	return (uint32_t) snprintf(path, size, "%s/%s", dir, name) >= size;
+}
+
+static void convert_one(pool_t *pool, job_t *job)
+{
+	state_snapshot_t snap;
+	char src_path[256];
+	char dst_path[256];
+
+	job->failed = 1;
+
+	if (join_path(src_path, sizeof(src_path), pool->src_dir, job->name) ||
+		join_path(dst_path, sizeof(dst_path), pool->dst_dir, job->name)) {
+		fprintf(stderr, "FATAL: Path too long for state file \"%s\" !\n", job->name);
+		return;
+	}
+
+	/* The tick counter is not stored in the small format, states are
+	 * simply read and written relative to 0
+	 */
+	memset(&snap, 0, sizeof(state_snapshot_t));
+	if (state_read(src_path, &snap)) {
+		return;
+	}
+
+	job->failed = state_write(dst_path, &snap, pool->small);
+}
+
+static int convert_thread(void *data)
+{
+	pool_t *pool = (pool_t *) data;
+	uint32_t i;
+
+	while ((i = SDL_AtomicAdd(&(pool->next), 1)) < pool->num) {
+		convert_one(pool, &(pool->jobs[i]));
+	}
+
+	return 0;
+}
+
+/* Lists the regular files of dir, apart from the manifest and the
+ * temporary files left by interrupted writes
+ */
+static bool_t list_states(pool_t *pool, char *dir)
+{
+	DIR *d;
+	struct dirent *entry;
+	struct stat st;
+	char path[256];
+	job_t *new_jobs;
+	uint32_t max = 0;
+	size_t len;
+
+	d = opendir(dir);
+	if (d == NULL) {
+		fprintf(stderr, "FATAL: Cannot open directory \"%s\" !\n", dir);
+		return 1;
+	}
+
+	while ((entry = readdir(d)) != NULL) {
+		len = strlen(entry->d_name);
+		if (entry->d_name[0] == '.' || !strcmp(entry->d_name, STATE_MANIFEST) ||
+			(len >= strlen(STATE_TMP_SUFFIX) && !strcmp(entry->d_name + len - strlen(STATE_TMP_SUFFIX), STATE_TMP_SUFFIX))) {
+			continue;
+		}
+
+		if (join_path(path, sizeof(path), dir, entry->d_name) || stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+			continue;
+		}
+
+		if (pool->num == max) {
+			max = max ? max * 2 : 64;
+			new_jobs = SDL_realloc(pool->jobs, max * sizeof(job_t));
+			if (new_jobs == NULL) {
+				fprintf(stderr, "FATAL: Cannot allocate the list of state files !\n");
+				closedir(d);
+				return 1;
+			}
+
+			pool->jobs = new_jobs;
+		}
+
+		pool->jobs[pool->num].name = SDL_strdup(entry->d_name);
+		pool->jobs[pool->num].size = (uint64_t) st.st_size;
+		pool->jobs[pool->num].failed = 1;
+		if (pool->jobs[pool->num].name == NULL) {
+			fprintf(stderr, "FATAL: Cannot allocate the list of state files !\n");
+			closedir(d);
+			return 1;
+		}
+
+		pool->num++;
+	}
+
+	closedir(d);
+
+	return 0;
+}
+
+/* Converts every state file of src_dir to the given format ("full" or
+ * "small"), writing them under the same name in dst_dir. Files are spread
+ * over one thread per CPU. Neither SDL nor the emulation is initialized.
+ */
+bool_t convert_states(char *src_dir, char *dst_dir, char *format)
+{
+	SDL_Thread *threads[CONVERT_MAX_THREADS];
+	uint32_t thread_num, failed = 0, i;
+	uint64_t bytes = 0, start, elapsed;
+	double seconds;
+	pool_t pool;
+
+	if (!strcmp(format, "full")) {
+		pool.small = 0;
+	} else if (!strcmp(format, "small")) {
+		pool.small = 1;
+	} else {
+		fprintf(stderr, "FATAL: Unknown state format \"%s\" (full or small expected) !\n", format);
+		return 1;
+	}
+
+	pool.src_dir = src_dir;
+	pool.dst_dir = dst_dir;
+	pool.jobs = NULL;
+	pool.num = 0;
+	SDL_AtomicSet(&(pool.next), 0);
+
+	if (list_states(&pool, src_dir)) {
+		for (i = 0; i < pool.num; i++) {
+			SDL_free(pool.jobs[i].name);
+		}
+		SDL_free(pool.jobs);
+		return 1;
+	}
+
+	start = SDL_GetPerformanceCounter();
+
+	thread_num = SDL_GetCPUCount();
+	if (thread_num > pool.num) {
+		thread_num = pool.num;
+	}
+	if (thread_num > CONVERT_MAX_THREADS) {
+		thread_num = CONVERT_MAX_THREADS;
+	}
+
+	for (i = 0; i < thread_num; i++) {
+		threads[i] = (thread_num > 1) ? SDL_CreateThread(&convert_thread, "convert", &pool) : NULL;
+		if (threads[i] == NULL) {
+			/* What is left is done by this thread */
+			break;
+		}
+	}
+	thread_num = i;
+
+	convert_thread(&pool);
+
+	for (i = 0; i < thread_num; i++) {
+		SDL_WaitThread(threads[i], NULL);
+	}
+
+	elapsed = SDL_GetPerformanceCounter() - start;
+	seconds = (double) elapsed / SDL_GetPerformanceFrequency();
+
+	for (i = 0; i < pool.num; i++) {
+		if (pool.jobs[i].failed) {
+			fprintf(stderr, "Failed to convert \"%s\"\n", pool.jobs[i].name);
+			failed++;
+		} else {
+			bytes += pool.jobs[i].size;
+		}
+
+		SDL_free(pool.jobs[i].name);
+	}
+
+	SDL_free(pool.jobs);
+
+	printf("Converted %u/%u state files in %.3f s (%.0f files/s, %.2f MB/s read)\n",
+		pool.num - failed, pool.num, seconds,
+		(seconds > 0) ? (pool.num - failed) / seconds : 0,
+		(seconds > 0) ? bytes / seconds / 1000000 : 0);
+
+	return failed > 0;
+}
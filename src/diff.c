@@ -0,0 +1,285 @@
+/*
+ * TamaTool - A cross-platform Tamagotchi P1 explorer
+ *
+ * Copyright (C) 2021 Jean-Christophe Rona <jc@rona.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "SDL.h"
+
+#include "diff.h"
+#include "state.h"
+
+#define DIFF_MAX_THREADS		64
+
+typedef struct {
+	char *buf;
+	size_t len;
+	size_t max;
+} text_t;
+
+typedef struct {
+	char **paths;
+	uint32_t num;
+	text_t *reports;
+	bool_t *failed;
+	SDL_atomic_t next;
+} batch_t;
+
+static state_snapshot_t base;
+
+
+static void text_printf(text_t *t, const char *fmt, ...)
+{
+	va_list args;
+	char *new_buf;
+	int n;
+
+	for (;;) {
+		va_start(args, fmt);
+		n = vsnprintf(t->buf + t->len, t->max - t->len, fmt, args);
+		va_end(args);
+
+		if (n < 0) {
+			return;
+		}
+
+		if (t->len + n < t->max) {
+			t->len += n;
+			return;
+		}
+
+		new_buf = SDL_realloc(t->buf, t->max * 2 + n + 1);
+		if (new_buf == NULL) {
+			return;
+		}
+
+		t->buf = new_buf;
+		t->max = t->max * 2 + n + 1;
+	}
+}
+
+static void text_nibbles(text_t *t, u4_t *nibbles, uint32_t num)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	char buf[65];
+	uint32_t i, n;
+
+	while (num > 0) {
+		n = (num < sizeof(buf) - 1) ? num : sizeof(buf) - 1;
+		for (i = 0; i < n; i++) {
+			buf[i] = hex[nibbles[i] & 0xF];
+		}
+		buf[n] = '\0';
+		text_printf(t, "%s", buf);
+
+		nibbles += n;
+		num -= n;
+	}
+}
+
+#define DIFF_FIELD(t, a, b, name, field, fmt) \
+	if ((a)->field != (b)->field) { \
+		text_printf(t, "%-6s " fmt " -> " fmt "\n", name, (a)->field, (b)->field); \
+	}
+
+static void diff_registers(text_t *t, state_snapshot_t *a, state_snapshot_t *b)
+{
+	uint32_t i;
+
+	DIFF_FIELD(t, a, b, "PC:", pc, "0x%04X");
+	DIFF_FIELD(t, a, b, "X:", x, "0x%03X");
+	DIFF_FIELD(t, a, b, "Y:", y, "0x%03X");
+	DIFF_FIELD(t, a, b, "A:", a, "0x%01X");
+	DIFF_FIELD(t, a, b, "B:", b, "0x%01X");
+	DIFF_FIELD(t, a, b, "NP:", np, "0x%02X");
+	DIFF_FIELD(t, a, b, "SP:", sp, "0x%02X");
+	DIFF_FIELD(t, a, b, "FL:", flags, "0x%01X");
+	DIFF_FIELD(t, a, b, "tick:", tick_counter, "0x%08X");
+	DIFF_FIELD(t, a, b, "clk:", clk_timer_timestamp, "0x%08X");
+	DIFF_FIELD(t, a, b, "prog:", prog_timer_timestamp, "0x%08X");
+	DIFF_FIELD(t, a, b, "EN:", prog_timer_enabled, "0x%01X");
+	DIFF_FIELD(t, a, b, "DATA:", prog_timer_data, "0x%02X");
+	DIFF_FIELD(t, a, b, "RLD:", prog_timer_rld, "0x%02X");
+	DIFF_FIELD(t, a, b, "depth:", call_depth, "0x%04X");
+
+	for (i = 0; i < INT_SLOT_NUM; i++) {
+		if (a->interrupts[i].factor_flag_reg != b->interrupts[i].factor_flag_reg) {
+			text_printf(t, "INT %X FLAG 0x%01X -> 0x%01X\n", i, a->interrupts[i].factor_flag_reg, b->interrupts[i].factor_flag_reg);
+		}
+		if (a->interrupts[i].mask_reg != b->interrupts[i].mask_reg) {
+			text_printf(t, "INT %X MASK 0x%01X -> 0x%01X\n", i, a->interrupts[i].mask_reg, b->interrupts[i].mask_reg);
+		}
+		if (a->interrupts[i].triggered != b->interrupts[i].triggered) {
+			text_printf(t, "INT %X TRIG 0x%01X -> 0x%01X\n", i, a->interrupts[i].triggered, b->interrupts[i].triggered);
+		}
+	}
+}
+
+static void print_range(text_t *t, state_snapshot_t *a, state_snapshot_t *b, uint32_t start, uint32_t end)
+{
+	text_printf(t, "%03X-%03X: ", start, end - 1);
+	text_nibbles(t, a->memory + start, end - start);
+	text_printf(t, " -> ");
+	text_nibbles(t, b->memory + start, end - start);
+	text_printf(t, "\n");
+}
+
+/* Nibbles are compared 8 at a time (one per byte), and only the words that
+ * differ are looked at closely. Changed nibbles are coalesced into ranges.
+ */
+static void diff_memory(text_t *t, state_snapshot_t *a, state_snapshot_t *b)
+{
+	uint64_t wa, wb;
+	uint32_t i, j, start = 0;
+	bool_t in_range = 0;
+
+	for (i = 0; i < MEMORY_SIZE; i += 8) {
+		memcpy(&wa, a->memory + i, 8);
+		memcpy(&wb, b->memory + i, 8);
+
+		if (!(wa ^ wb)) {
+			if (in_range) {
+				print_range(t, a, b, start, i);
+				in_range = 0;
+			}
+			continue;
+		}
+
+		for (j = i; j < i + 8; j++) {
+			if (a->memory[j] != b->memory[j]) {
+				if (!in_range) {
+					start = j;
+					in_range = 1;
+				}
+			} else if (in_range) {
+				print_range(t, a, b, start, j);
+				in_range = 0;
+			}
+		}
+	}
+
+	if (in_range) {
+		print_range(t, a, b, start, MEMORY_SIZE);
+	}
+}
+
+static bool_t diff_one(text_t *t, char *path)
+{
+	state_snapshot_t snap;
+	size_t len;
+
+	memset(&snap, 0, sizeof(state_snapshot_t));
+	if (state_read(path, &snap)) {
+		return 1;
+	}
+
+	text_printf(t, "+++ %s\n", path);
+	len = t->len;
+
+	diff_registers(t, &base, &snap);
+	diff_memory(t, &base, &snap);
+
+	if (t->len == len) {
+		text_printf(t, "No difference\n");
+	}
+
+	return 0;
+}
+
+static int batch_thread(void *data)
+{
+	batch_t *batch = (batch_t *) data;
+	uint32_t i;
+
+	while ((i = SDL_AtomicAdd(&(batch->next), 1)) < batch->num) {
+		batch->failed[i] = diff_one(&(batch->reports[i]), batch->paths[i]);
+	}
+
+	return 0;
+}
+
+/* Compares each state with the base one. States are read and compared in
+ * parallel, and the reports printed in order.
+ */
+bool_t diff_states(char *base_path, char **paths, uint32_t num)
+{
+	SDL_Thread *threads[DIFF_MAX_THREADS];
+	uint32_t thread_num, i;
+	batch_t batch;
+	bool_t ret = 0;
+
+	memset(&base, 0, sizeof(state_snapshot_t));
+	if (state_read(base_path, &base)) {
+		return 1;
+	}
+
+	batch.paths = paths;
+	batch.num = num;
+	batch.reports = SDL_calloc(num, sizeof(text_t));
+	batch.failed = SDL_calloc(num, sizeof(bool_t));
+	SDL_AtomicSet(&(batch.next), 0);
+	if (batch.reports == NULL || batch.failed == NULL) {
+		fprintf(stderr, "FATAL: Cannot allocate the diff reports !\n");
+		SDL_free(batch.reports);
+		SDL_free(batch.failed);
+		return 1;
+	}
+
+	thread_num = SDL_GetCPUCount();
+	if (thread_num > num) {
+		thread_num = num;
+	}
+	if (thread_num > DIFF_MAX_THREADS) {
+		thread_num = DIFF_MAX_THREADS;
+	}
+
+	for (i = 0; i < thread_num; i++) {
+		threads[i] = (thread_num > 1) ? SDL_CreateThread(&batch_thread, "diff", &batch) : NULL;
+		if (threads[i] == NULL) {
+			/* What is left is done by this thread */
+			break;
+		}
+	}
+	thread_num = i;
+
+	batch_thread(&batch);
+
+	for (i = 0; i < thread_num; i++) {
+		SDL_WaitThread(threads[i], NULL);
+	}
+
+	printf("--- %s\n", base_path);
+	for (i = 0; i < num; i++) {
+		if (batch.failed[i]) {
+			ret = 1;
+		} else {
+			fwrite(batch.reports[i].buf, 1, batch.reports[i].len, stdout);
+		}
+
+		SDL_free(batch.reports[i].buf);
+	}
+
+	SDL_free(batch.reports);
+	SDL_free(batch.failed);
+
+	return ret;
+}
@@ -0,0 +1,207 @@
+/*
+ * TamaTool - A cross-platform Tamagotchi P1 explorer
+ *
+ * Copyright (C) 2021 Jean-Christophe Rona <jc@rona.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "SDL.h"
+
+#include "lib/tamalib.h"
+
+#include "grid.h"
+#include "state.h"
+#include "lcd.h"
+
+#define BTN_NUM				3
+
+/* tamalib only runs a single CPU, so the pets share it in turn: the state
+ * of each pet is swapped in, run for a time slice, and swapped out.
+ */
+static state_snapshot_t *pets = NULL;
+static uint32_t pet_num = 0;
+static uint32_t loaded = 0; // Pet currently in the CPU
+static uint32_t focus = 0; // Pet receiving the inputs
+
+static btn_state_t buttons[BTN_NUM]; // Requested by the user
+static btn_state_t focus_buttons[BTN_NUM]; // Last seen by the focused pet
+
+
+/* Load each of the given saves into a pet, the remaining pets being clones
+ * of the current emulation state
+ */
+bool_t grid_init(uint32_t num, char **save_paths, uint32_t save_num)
+{
+	uint32_t i;
+
+	if (num == 0 || num > GRID_MAX_PETS) {
+		fprintf(stderr, "FATAL: The number of pets must be between 1 and %u !\n", GRID_MAX_PETS);
+		return 1;
+	}
+
+	if (save_num > num) {
+		fprintf(stderr, "FATAL: More saves (%u) than pets (%u) !\n", save_num, num);
+		return 1;
+	}
+
+	pets = (state_snapshot_t *) SDL_malloc(num * sizeof(state_snapshot_t));
+	if (pets == NULL) {
+		fprintf(stderr, "FATAL: Cannot allocate the pets !\n");
+		return 1;
+	}
+
+	for (i = 0; i < num; i++) {
+		state_capture(&pets[i]);
+
+		if (i < save_num && state_read(save_paths[i], &pets[i])) {
+			SDL_free(pets);
+			pets = NULL;
+			return 1;
+		}
+	}
+
+	pet_num = num;
+	loaded = focus = 0;
+
+	for (i = 0; i < BTN_NUM; i++) {
+		buttons[i] = focus_buttons[i] = BTN_STATE_RELEASED;
+	}
+
+	return 0;
+}
+
+void grid_release(void)
+{
+	SDL_free(pets);
+	pets = NULL;
+	pet_num = 0;
+}
+
+uint32_t grid_get_num(void)
+{
+	return pet_num;
+}
+
+static void load_pet(uint32_t pet)
+{
+	uint32_t i;
+
+	if (pet == loaded) {
+		return;
+	}
+
+	state_capture(&pets[loaded]);
+
+	/* The input pins are not part of the state: set them as the pet last
+	 * saw them before restoring its state, so that the interrupts they
+	 * may trigger are overwritten
+	 */
+	for (i = 0; i < BTN_NUM; i++) {
+		tamalib_set_button((button_t) i, (pet == focus) ? focus_buttons[i] : BTN_STATE_RELEASED);
+	}
+
+	/* Restoring refreshes the hardware, whose callbacks must already see
+	 * the new pet as loaded
+	 */
+	loaded = pet;
+	state_restore(&pets[pet]);
+}
+
+/* Run every pet for the given emulated time */
+void grid_run_for(u32_t ticks)
+{
+	state_t *state = tamalib_get_state();
+	uint32_t first = loaded;
+	uint32_t i, j, target;
+
+	for (i = 0; i < pet_num; i++) {
+		/* Start with the loaded pet to save a swap */
+		load_pet((first + i) % pet_num);
+
+		if (loaded == focus) {
+			for (j = 0; j < BTN_NUM; j++) {
+				if (buttons[j] != focus_buttons[j]) {
+					focus_buttons[j] = buttons[j];
+					tamalib_set_button((button_t) j, buttons[j]);
+				}
+			}
+		}
+
+		/* Each instruction takes at least one tick, so the step count
+		 * bounds the loop even if the CPU does not move forward
+		 */
+		target = *(state->tick_counter) + ticks;
+		for (j = 0; j < ticks && (int32_t) (*(state->tick_counter) - target) < 0; j++) {
+			tamalib_step();
+		}
+	}
+}
+
+void grid_get_frame(uint32_t pet, lcd_frame_t *frame)
+{
+	if (pet == loaded) {
+		lcd_decode_frame(tamalib_get_state()->memory, frame);
+	} else {
+		lcd_decode_frame(pets[pet].memory, frame);
+	}
+}
+
+void grid_set_focus(uint32_t pet)
+{
+	uint32_t i;
+
+	if (pet >= pet_num || pet == focus) {
+		return;
+	}
+
+	/* Buttons held on the previous pet are dropped */
+	for (i = 0; i < BTN_NUM; i++) {
+		buttons[i] = focus_buttons[i] = BTN_STATE_RELEASED;
+	}
+
+	if (loaded == focus) {
+		for (i = 0; i < BTN_NUM; i++) {
+			tamalib_set_button((button_t) i, BTN_STATE_RELEASED);
+		}
+	}
+
+	focus = pet;
+}
+
+uint32_t grid_get_focus(void)
+{
+	return focus;
+}
+
+/* Applied to the focused pet during its next time slice */
+void grid_set_button(button_t btn, btn_state_t state)
+{
+	buttons[btn] = state;
+}
+
+/* Swap the focused pet in, so that the state functions apply to it */
+void grid_load_focus(void)
+{
+	load_pet(focus);
+}
+
+bool_t grid_is_focus_loaded(void)
+{
+	return (loaded == focus);
+}
@@ -0,0 +1,41 @@
+/*
+ * TamaTool - A cross-platform Tamagotchi P1 explorer
+ *
+ * Copyright (C) 2021 Jean-Christophe Rona <jc@rona.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#ifndef _GRID_H_
+#define _GRID_H_
+
+#include "lib/tamalib.h"
+
+#include "lcd.h"
+
+#define GRID_MAX_PETS			256
+
+
+bool_t grid_init(uint32_t num, char **save_paths, uint32_t save_num);
+void grid_release(void);
+uint32_t grid_get_num(void);
+void grid_run_for(u32_t ticks);
+void grid_get_frame(uint32_t pet, lcd_frame_t *frame);
+void grid_set_focus(uint32_t pet);
+uint32_t grid_get_focus(void);
+void grid_set_button(button_t btn, btn_state_t state);
+void grid_load_focus(void);
+bool_t grid_is_focus_loaded(void);
+
+#endif /* _GRID_H_ */
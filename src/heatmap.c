@@ -0,0 +1,91 @@
+/*
+ * TamaTool - A cross-platform Tamagotchi P1 explorer
+ *
+ * Copyright (C) 2021 Jean-Christophe Rona <jc@rona.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "heatmap.h"
+
+#define HEAT_MAX			255
+
+/* Saturating counters, decayed by a quarter on every frame */
+static uint8_t read_heat[MEMORY_SIZE];
+static uint8_t write_heat[MEMORY_SIZE];
+static bool_t heatmap_enabled = 0;
+
+/* Minimum heat of each level */
+static const uint8_t level_heat[HEATMAP_LEVELS] = {1, 8, 32, 128};
+
+
+void heatmap_start(void)
+{
+	memset(read_heat, 0, sizeof(read_heat));
+	memset(write_heat, 0, sizeof(write_heat));
+	heatmap_enabled = 1;
+}
+
+bool_t heatmap_is_enabled(void)
+{
+	return heatmap_enabled;
+}
+
+void heatmap_read(u12_t addr)
+{
+	if (read_heat[addr] < HEAT_MAX) {
+		read_heat[addr]++;
+	}
+}
+
+void heatmap_write(u12_t addr)
+{
+	if (write_heat[addr] < HEAT_MAX) {
+		write_heat[addr]++;
+	}
+}
+
+void heatmap_decay(void)
+{
+	uint32_t i;
+
+	for (i = 0; i < MEMORY_SIZE; i++) {
+		read_heat[i] = (read_heat[i] * 3) >> 2;
+		write_heat[i] = (write_heat[i] * 3) >> 2;
+	}
+}
+
+/* Writes take precedence over reads, level being from 0 to HEATMAP_LEVELS - 1 */
+heat_type_t heatmap_get(u12_t addr, uint8_t *level)
+{
+	heat_type_t type = HEAT_WRITE;
+	uint8_t heat = write_heat[addr];
+
+	if (heat == 0) {
+		type = HEAT_READ;
+		heat = read_heat[addr];
+	}
+
+	if (heat == 0) {
+		return HEAT_NONE;
+	}
+
+	for (*level = HEATMAP_LEVELS - 1; heat < level_heat[*level]; (*level)--);
+
+	return type;
+}
@@ -0,0 +1,41 @@
+/*
+ * TamaTool - A cross-platform Tamagotchi P1 explorer
+ *
+ * Copyright (C) 2021 Jean-Christophe Rona <jc@rona.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#ifndef _HEATMAP_H_
+#define _HEATMAP_H_
+
+#include "lib/tamalib.h"
+
+#define HEATMAP_LEVELS			4
+
+typedef enum {
+	HEAT_NONE,
+	HEAT_READ,
+	HEAT_WRITE,
+} heat_type_t;
+
+
+void heatmap_start(void);
+bool_t heatmap_is_enabled(void);
+void heatmap_read(u12_t addr);
+void heatmap_write(u12_t addr);
+void heatmap_decay(void);
+heat_type_t heatmap_get(u12_t addr, uint8_t *level);
+
+#endif /* _HEATMAP_H_ */
@@ -0,0 +1,168 @@
+/*
+ * TamaTool - A cross-platform Tamagotchi P1 explorer
+ *
+ * Copyright (C) 2021 Jean-Christophe Rona <jc@rona.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "lib/tamalib.h"
+
+#include "lcd.h"
+
+#define DISPLAY1_ADDR			0xE00 // COM0 to COM7
+#define DISPLAY2_ADDR			0xE80 // COM8 to COM15
+#define SEG_NUM				40
+
+/* X position of each segment on the dot matrix (same mapping as tamalib's hw.c).
+ * Segments mapped beyond LCD_WIDTH are not part of the dot matrix.
+ */
+static const u8_t seg_pos[SEG_NUM] = {0, 1, 2, 3, 4, 5, 6, 7, 32, 8, 9, 10, 11, 12, 13, 14, 15, 33, 34, 35, 31, 30, 29, 28, 27, 26, 25, 24, 36, 23, 22, 21, 20, 19, 18, 17, 16, 37, 38, 39};
+
+static lcd_frame_t pending_frame = {{0}};	// Updated pixel by pixel by the emulation
+static lcd_frame_t current_frame = {{0}};	// Last committed frame
+static uint32_t generation = 0;
+
+static const u4_t *display_memory = NULL;	// Decoded lazily when set
+bool_t g_lcd_dirty = 0;
+
+
+void lcd_set_pixel(u8_t x, u8_t y, bool_t val)
+{
+	if (val) {
+		pending_frame.rows[y] |= (1UL << x);
+	} else {
+		pending_frame.rows[y] &= ~(1UL << x);
+	}
+}
+
+void lcd_set_icon(u8_t icon, bool_t val)
+{
+	if (val) {
+		pending_frame.icons |= (1 << icon);
+	} else {
+		pending_frame.icons &= ~(1 << icon);
+	}
+}
+
+/* Decode the whole display memory into a frame at once.
+ * Each segment owns two nibbles per display memory, holding COM0-3 and
+ * COM4-7 (resp. COM8-11 and COM12-15).
+ */
+void lcd_decode_frame(const u4_t *memory, lcd_frame_t *frame)
+{
+	const u4_t *d1 = memory + DISPLAY1_ADDR;
+	const u4_t *d2 = memory + DISPLAY2_ADDR;
+	uint32_t rows[LCD_HEIGHT] = {0};
+	uint32_t bit;
+	u8_t seg, i;
+
+	for (seg = 0; seg < SEG_NUM; seg++) {
+		if (seg_pos[seg] >= LCD_WIDTH) {
+			continue;
+		}
+
+		bit = 1UL << seg_pos[seg];
+
+		for (i = 0; i < 4; i++) {
+			if ((d1[seg * 2] >> i) & 0x1) rows[i] |= bit;
+			if ((d1[seg * 2 + 1] >> i) & 0x1) rows[4 + i] |= bit;
+			if ((d2[seg * 2] >> i) & 0x1) rows[8 + i] |= bit;
+			if ((d2[seg * 2 + 1] >> i) & 0x1) rows[12 + i] |= bit;
+		}
+	}
+
+	memcpy(frame->rows, rows, sizeof(rows));
+
+	/* Icons 0-3 are SEG8/COM0-3, icons 4-7 are SEG28/COM12-15 */
+	frame->icons = (d1[8 * 2] & 0xF) | ((d2[28 * 2 + 1] & 0xF) << 4);
+}
+
+void lcd_decode_memory(const u4_t *memory)
+{
+	lcd_decode_frame(memory, &pending_frame);
+}
+
+/* Once set, display memory is decoded only when a frame is committed
+ * and only if it has been invalidated in the meantime, so that writes
+ * to display memory are just a flag update.
+ */
+void lcd_set_memory(const u4_t *memory)
+{
+	display_memory = memory;
+	g_lcd_dirty = 1;
+}
+
+/* Publish the pending frame if it differs from the current one.
+ * Returns 1 (and bumps the generation counter) if the screen changed.
+ */
+bool_t lcd_commit(void)
+{
+	if (display_memory != NULL) {
+		if (!g_lcd_dirty) {
+			return 0;
+		}
+
+		g_lcd_dirty = 0;
+		lcd_decode_memory(display_memory);
+	}
+
+	if (!lcd_frame_diff(&pending_frame, &current_frame, NULL)) {
+		return 0;
+	}
+
+	memcpy(&current_frame, &pending_frame, sizeof(lcd_frame_t));
+	generation++;
+
+	return 1;
+}
+
+const lcd_frame_t * lcd_get_frame(void)
+{
+	return &current_frame;
+}
+
+uint32_t lcd_get_generation(void)
+{
+	return generation;
+}
+
+/* Word-wise comparison of two frames. If diff is not NULL, it receives
+ * the XOR of both frames (changed pixels and icons are set).
+ * Returns 1 if the frames differ.
+ */
+bool_t lcd_frame_diff(const lcd_frame_t *a, const lcd_frame_t *b, lcd_frame_t *diff)
+{
+	uint32_t changed;
+	u8_t y;
+
+	changed = a->icons ^ b->icons;
+	if (diff != NULL) {
+		diff->icons = changed;
+	}
+
+	for (y = 0; y < LCD_HEIGHT; y++) {
+		if (diff != NULL) {
+			diff->rows[y] = a->rows[y] ^ b->rows[y];
+			changed |= diff->rows[y];
+		} else {
+			changed |= a->rows[y] ^ b->rows[y];
+		}
+	}
+
+	return !!changed;
+}
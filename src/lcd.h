@@ -0,0 +1,52 @@
+/*
+ * TamaTool - A cross-platform Tamagotchi P1 explorer
+ *
+ * Copyright (C) 2021 Jean-Christophe Rona <jc@rona.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#ifndef _LCD_H_
+#define _LCD_H_
+
+#include "lib/tamalib.h"
+
+#define LCD_FRAME_PIXEL(f, x, y)	(((f)->rows[y] >> (x)) & 0x1)
+#define LCD_FRAME_ICON(f, i)		(((f)->icons >> (i)) & 0x1)
+
+/* Packed LCD frame: bit x of rows[y] is the pixel (x, y) and bit i of icons
+ * is the icon i, so that a whole frame fits in 64 + 1 bytes
+ */
+typedef struct {
+	uint32_t rows[LCD_HEIGHT];
+	uint8_t icons;
+} lcd_frame_t;
+
+extern bool_t g_lcd_dirty;
+
+/* To be called whenever display memory is written */
+#define lcd_invalidate()		(g_lcd_dirty = 1)
+
+
+void lcd_set_pixel(u8_t x, u8_t y, bool_t val);
+void lcd_set_icon(u8_t icon, bool_t val);
+void lcd_decode_frame(const u4_t *memory, lcd_frame_t *frame);
+void lcd_decode_memory(const u4_t *memory);
+void lcd_set_memory(const u4_t *memory);
+bool_t lcd_commit(void);
+const lcd_frame_t * lcd_get_frame(void);
+uint32_t lcd_get_generation(void);
+bool_t lcd_frame_diff(const lcd_frame_t *a, const lcd_frame_t *b, lcd_frame_t *diff);
+
+#endif /* _LCD_H_ */
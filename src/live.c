@@ -0,0 +1,262 @@
+/*
+ * TamaTool - A cross-platform Tamagotchi P1 explorer
+ *
+ * Copyright (C) 2021 Jean-Christophe Rona <jc@rona.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__WIN32__)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#include "SDL.h"
+
+#include "live.h"
+#include "state.h"
+
+#define LIVE_UPDATE_INTERVAL		20 // ms, time between two copies of the state to the mapping
+#define LIVE_SLOT_SIZE			8192 // Bytes, a state followed by its sequence number
+#define LIVE_SLOT_NUM			2
+#define LIVE_FILE_SIZE			(LIVE_SLOT_SIZE * LIVE_SLOT_NUM)
+#define LIVE_SEQUENCE_OFFSET		(LIVE_SLOT_SIZE - 4)
+
+/* The state is copied alternately to two slots of a file mapped in memory,
+ * so that the kernel persists it without any write on the emulation side.
+ * The previous slot stays intact while the other one is being updated,
+ * the valid one with the highest sequence number being loaded on restart.
+ */
+static uint8_t *live_data = NULL;
+static uint32_t live_slot = 0; // Next one to update
+static uint32_t live_sequence = 0;
+static uint32_t live_sync_interval;
+static uint32_t last_update = 0;
+static uint32_t last_sync = 0;
+
+#if defined(__WIN32__)
+static HANDLE live_file = INVALID_HANDLE_VALUE;
+static HANDLE live_mapping = NULL;
+#else
+static int live_fd = -1;
+#endif
+
+
+static bool_t map_live_file(char *path)
+{
+#if defined(__WIN32__)
+	live_file = CreateFile(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (live_file == INVALID_HANDLE_VALUE) {
+		fprintf(stderr, "FATAL: Cannot open live state file \"%s\" !\n", path);
+		return 1;
+	}
+
+	/* The file is extended to the size of the mapping if needed */
+	live_mapping = CreateFileMapping(live_file, NULL, PAGE_READWRITE, 0, LIVE_FILE_SIZE, NULL);
+	if (live_mapping != NULL) {
+		live_data = MapViewOfFile(live_mapping, FILE_MAP_ALL_ACCESS, 0, 0, LIVE_FILE_SIZE);
+	}
+
+	if (live_data == NULL) {
+		fprintf(stderr, "FATAL: Cannot map live state file \"%s\" !\n", path);
+		if (live_mapping != NULL) {
+			CloseHandle(live_mapping);
+			live_mapping = NULL;
+		}
+		CloseHandle(live_file);
+		live_file = INVALID_HANDLE_VALUE;
+		return 1;
+	}
+#else
+	void *data;
+
+	live_fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (live_fd < 0) {
+		fprintf(stderr, "FATAL: Cannot open live state file \"%s\" !\n", path);
+		return 1;
+	}
+
+	if (ftruncate(live_fd, LIVE_FILE_SIZE) != 0) {
+		fprintf(stderr, "FATAL: Cannot resize live state file \"%s\" !\n", path);
+		close(live_fd);
+		live_fd = -1;
+		return 1;
+	}
+
+	data = mmap(NULL, LIVE_FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, live_fd, 0);
+	if (data == MAP_FAILED) {
+		fprintf(stderr, "FATAL: Cannot map live state file \"%s\" !\n", path);
+		close(live_fd);
+		live_fd = -1;
+		return 1;
+	}
+
+	live_data = (uint8_t *) data;
+#endif
+
+	return 0;
+}
+
+/* Only waits for the data to reach the disk if asked to, the periodic
+ * syncs running on the emulation thread
+ */
+static void sync_live_file(bool_t wait)
+{
+#if defined(__WIN32__)
+	FlushViewOfFile(live_data, LIVE_FILE_SIZE);
+	if (wait) {
+		FlushFileBuffers(live_file);
+	}
+#else
+	msync(live_data, LIVE_FILE_SIZE, wait ? MS_SYNC : MS_ASYNC);
+#endif
+}
+
+static uint32_t get_sequence(uint8_t *slot)
+{
+	uint8_t *data = slot + LIVE_SEQUENCE_OFFSET;
+
+	return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t) data[3] << 24);
+}
+
+static void set_sequence(uint8_t *slot, uint32_t sequence)
+{
+	uint8_t *data = slot + LIVE_SEQUENCE_OFFSET;
+
+	data[0] = sequence & 0xFF;
+	data[1] = (sequence >> 8) & 0xFF;
+	data[2] = (sequence >> 16) & 0xFF;
+	data[3] = sequence >> 24;
+}
+
+/* Restores the most recent valid slot, if any */
+static void restore_live_state(char *path)
+{
+	state_snapshot_t snap;
+	uint8_t *slot;
+	bool_t found = 0;
+	uint32_t i;
+
+	for (i = 0; i < LIVE_SLOT_NUM; i++) {
+		slot = live_data + i * LIVE_SLOT_SIZE;
+
+		/* Never written */
+		if (slot[0] == 0) {
+			continue;
+		}
+
+		if (found && (int32_t) (get_sequence(slot) - live_sequence) <= 0) {
+			continue;
+		}
+
+		memset(&snap, 0, sizeof(state_snapshot_t));
+		if (state_decode(slot, LIVE_SEQUENCE_OFFSET, path, &snap)) {
+			continue;
+		}
+
+		live_sequence = get_sequence(slot);
+		live_slot = (i + 1) % LIVE_SLOT_NUM;
+		found = 1;
+
+		state_restore(&snap);
+	}
+}
+
+/* Maps the given file, restoring the state it holds (if any). The state
+ * is then copied to it as often as possible, and written back to the disk
+ * every sync_interval ms, without waiting for it but when closing.
+ */
+bool_t live_open(char *path, uint32_t sync_interval)
+{
+	if (map_live_file(path)) {
+		return 1;
+	}
+
+	live_sync_interval = sync_interval;
+
+	restore_live_state(path);
+
+	last_update = last_sync = SDL_GetTicks();
+
+	return 0;
+}
+
+static void update_live_state(void)
+{
+	state_snapshot_t snap;
+	uint8_t *slot = live_data + live_slot * LIVE_SLOT_SIZE;
+
+	state_capture(&snap);
+	if (!state_encode(&snap, slot, LIVE_SEQUENCE_OFFSET)) {
+		return;
+	}
+
+	/* Set once the state is complete, a torn slot being ignored anyway */
+	set_sequence(slot, ++live_sequence);
+	live_slot = (live_slot + 1) % LIVE_SLOT_NUM;
+}
+
+/* Called as often as possible from the emulation thread */
+void live_poll(void)
+{
+	uint32_t now;
+
+	if (live_data == NULL) {
+		return;
+	}
+
+	now = SDL_GetTicks();
+
+	if (now - last_update >= LIVE_UPDATE_INTERVAL) {
+		last_update = now;
+		update_live_state();
+	}
+
+	if (now - last_sync >= live_sync_interval) {
+		last_sync = now;
+		sync_live_file(0);
+	}
+}
+
+void live_close(void)
+{
+	if (live_data == NULL) {
+		return;
+	}
+
+	update_live_state();
+	sync_live_file(1);
+
+#if defined(__WIN32__)
+	UnmapViewOfFile(live_data);
+	CloseHandle(live_mapping);
+	CloseHandle(live_file);
+	live_mapping = NULL;
+	live_file = INVALID_HANDLE_VALUE;
+#else
+	munmap(live_data, LIVE_FILE_SIZE);
+	close(live_fd);
+	live_fd = -1;
+#endif
+
+	live_data = NULL;
+}
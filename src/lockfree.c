@@ -0,0 +1,132 @@
+/*
+ * TamaTool - A cross-platform Tamagotchi P1 explorer
+ *
+ * Copyright (C) 2021 Jean-Christophe Rona <jc@rona.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "SDL.h"
+
+#include "lockfree.h"
+
+#define TRIPLE_BUFFER_FRESH		0x4
+
+
+/* storage must hold 3 slots of slot_size bytes */
+void triple_buffer_init(triple_buffer_t *tb, void *storage, uint32_t slot_size)
+{
+	tb->storage = (uint8_t *) storage;
+	tb->slot_size = slot_size;
+	tb->back = 0;
+	SDL_AtomicSet(&(tb->middle), 1);
+	tb->front = 2;
+}
+
+/* Producer side: slot to fill before calling triple_buffer_publish() */
+void * triple_buffer_get_back(triple_buffer_t *tb)
+{
+	return tb->storage + tb->back * tb->slot_size;
+}
+
+void triple_buffer_publish(triple_buffer_t *tb)
+{
+	/* The slot content must be visible before its index is */
+	SDL_MemoryBarrierRelease();
+	tb->back = SDL_AtomicSet(&(tb->middle), tb->back | TRIPLE_BUFFER_FRESH) & ~TRIPLE_BUFFER_FRESH;
+	SDL_MemoryBarrierAcquire();
+}
+
+/* Consumer side: returns the latest published slot, fresh is set to 1
+ * if it was not returned before
+ */
+void * triple_buffer_get_front(triple_buffer_t *tb, bool_t *fresh)
+{
+	*fresh = 0;
+
+	if (SDL_AtomicGet(&(tb->middle)) & TRIPLE_BUFFER_FRESH) {
+		SDL_MemoryBarrierRelease();
+		tb->front = SDL_AtomicSet(&(tb->middle), tb->front) & ~TRIPLE_BUFFER_FRESH;
+		SDL_MemoryBarrierAcquire();
+		*fresh = 1;
+	}
+
+	return tb->storage + tb->front * tb->slot_size;
+}
+
+/* storage must hold capacity elements of elem_size bytes */
+void spsc_queue_init(spsc_queue_t *q, void *storage, uint32_t elem_size, uint32_t capacity)
+{
+	q->storage = (uint8_t *) storage;
+	q->elem_size = elem_size;
+	q->mask = capacity - 1;
+	SDL_AtomicSet(&(q->head), 0);
+	SDL_AtomicSet(&(q->tail), 0);
+}
+
+/* Producer side, returns 1 if the queue is full */
+bool_t spsc_queue_push(spsc_queue_t *q, const void *elem)
+{
+	uint32_t tail = SDL_AtomicGet(&(q->tail));
+
+	if (tail - (uint32_t) SDL_AtomicGet(&(q->head)) > q->mask) {
+		return 1;
+	}
+
+	/* The slot must be released by the consumer before being overwritten,
+	 * and filled before the new tail is visible
+	 */
+	SDL_MemoryBarrierAcquire();
+	memcpy(q->storage + (tail & q->mask) * q->elem_size, elem, q->elem_size);
+	SDL_MemoryBarrierRelease();
+	SDL_AtomicSet(&(q->tail), tail + 1);
+
+	return 0;
+}
+
+/* Consumer side, returns 1 if the queue is empty. The element is kept queued. */
+bool_t spsc_queue_peek(spsc_queue_t *q, void *elem)
+{
+	uint32_t head = SDL_AtomicGet(&(q->head));
+
+	if (head == (uint32_t) SDL_AtomicGet(&(q->tail))) {
+		return 1;
+	}
+
+	SDL_MemoryBarrierAcquire();
+	memcpy(elem, q->storage + (head & q->mask) * q->elem_size, q->elem_size);
+
+	return 0;
+}
+
+/* Consumer side, returns 1 if the queue is empty */
+bool_t spsc_queue_pop(spsc_queue_t *q, void *elem)
+{
+	uint32_t head = SDL_AtomicGet(&(q->head));
+
+	if (head == (uint32_t) SDL_AtomicGet(&(q->tail))) {
+		return 1;
+	}
+
+	/* The slot must be read after the tail, and before being released */
+	SDL_MemoryBarrierAcquire();
+	memcpy(elem, q->storage + (head & q->mask) * q->elem_size, q->elem_size);
+	SDL_MemoryBarrierRelease();
+	SDL_AtomicSet(&(q->head), head + 1);
+
+	return 0;
+}
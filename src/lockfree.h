@@ -0,0 +1,60 @@
+/*
+ * TamaTool - A cross-platform Tamagotchi P1 explorer
+ *
+ * Copyright (C) 2021 Jean-Christophe Rona <jc@rona.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#ifndef _LOCKFREE_H_
+#define _LOCKFREE_H_
+
+#include "SDL.h"
+
+#include "hal_types.h"
+
+/* Single producer, single consumer triple buffer: the producer always has
+ * a slot to write into, and the consumer always gets the latest complete one
+ */
+typedef struct {
+	uint8_t *storage;
+	uint32_t slot_size;
+	SDL_atomic_t middle; // Slot index, ORed with TRIPLE_BUFFER_FRESH when not consumed yet
+	int back; // Owned by the producer
+	int front; // Owned by the consumer
+} triple_buffer_t;
+
+/* Single producer, single consumer queue of fixed size elements,
+ * the capacity must be a power of 2
+ */
+typedef struct {
+	uint8_t *storage;
+	uint32_t elem_size;
+	uint32_t mask;
+	SDL_atomic_t head; // Written by the consumer
+	SDL_atomic_t tail; // Written by the producer
+} spsc_queue_t;
+
+
+void triple_buffer_init(triple_buffer_t *tb, void *storage, uint32_t slot_size);
+void * triple_buffer_get_back(triple_buffer_t *tb);
+void triple_buffer_publish(triple_buffer_t *tb);
+void * triple_buffer_get_front(triple_buffer_t *tb, bool_t *fresh);
+
+void spsc_queue_init(spsc_queue_t *q, void *storage, uint32_t elem_size, uint32_t capacity);
+bool_t spsc_queue_push(spsc_queue_t *q, const void *elem);
+bool_t spsc_queue_peek(spsc_queue_t *q, void *elem);
+bool_t spsc_queue_pop(spsc_queue_t *q, void *elem);
+
+#endif /* _LOCKFREE_H_ */
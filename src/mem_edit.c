@@ -22,6 +22,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <sys/select.h>
 #include <termios.h>
@@ -29,6 +30,80 @@
 #include "lib/tamalib.h"
 
 #include "mem_edit.h"
+#include "lcd.h"
+#include "trace.h"
+#include "heatmap.h"
+#include "shadow.h"
+
+/* Screen layout (rows), the first one being left empty */
+#define MEMORY_ROW				1
+#define VARIABLES_ROW				(MEMORY_ROW + MEMORY_SIZE / 0x80 + 1)
+#define CURSOR_ROW				(VARIABLES_ROW + 2)
+#define TRACE_ROW				(CURSOR_ROW + 1)
+#define SCREEN_ROWS				(TRACE_ROW + 1)
+#define SCREEN_COLS				(7 + 0x80)
+
+/* Worst case: every cell moved to, with its own attribute */
+#define OUTPUT_BUFFER_SIZE			(SCREEN_ROWS * SCREEN_COLS * 24 + 64)
+
+/* Cell attributes, each escape sequence being self-contained */
+typedef enum {
+	ATTR_NONE,
+	ATTR_LABEL,
+	ATTR_CURSOR,
+	ATTR_DISPLAY1,
+	ATTR_DISPLAY2,
+	ATTR_IO,
+	ATTR_INVALID,
+	ATTR_TITLE,
+	ATTR_LEGEND_RAM,
+	ATTR_LEGEND_DISPLAY1,
+	ATTR_LEGEND_DISPLAY2,
+	ATTR_LEGEND_IO,
+	ATTR_LEGEND_INVALID,
+	ATTR_HEAT_READ, // HEATMAP_LEVELS of them
+	ATTR_HEAT_WRITE = ATTR_HEAT_READ + HEATMAP_LEVELS, // HEATMAP_LEVELS of them
+	ATTR_NUM = ATTR_HEAT_WRITE + HEATMAP_LEVELS,
+} attr_t;
+
+typedef struct {
+	char c;
+	uint8_t attr;
+} cell_t;
+
+static const char *attr_codes[ATTR_NUM] = {
+	[ATTR_NONE] = "\e[0m",
+	[ATTR_LABEL] = "\e[0;1;34m",
+	[ATTR_CURSOR] = "\e[0;30;42m",
+	[ATTR_DISPLAY1] = "\e[0;35m",
+	[ATTR_DISPLAY2] = "\e[0;36m",
+	[ATTR_IO] = "\e[0;33m",
+	[ATTR_INVALID] = "\e[0;90m",
+	[ATTR_TITLE] = "\e[0;1;32m",
+	[ATTR_LEGEND_RAM] = "\e[0;1;37m",
+	[ATTR_LEGEND_DISPLAY1] = "\e[0;1;35m",
+	[ATTR_LEGEND_DISPLAY2] = "\e[0;1;36m",
+	[ATTR_LEGEND_IO] = "\e[0;1;33m",
+	[ATTR_LEGEND_INVALID] = "\e[0;1;90m",
+	[ATTR_HEAT_READ] = "\e[0;97;48;5;17m",
+	[ATTR_HEAT_READ + 1] = "\e[0;97;48;5;19m",
+	[ATTR_HEAT_READ + 2] = "\e[0;97;48;5;27m",
+	[ATTR_HEAT_READ + 3] = "\e[0;30;48;5;45m",
+	[ATTR_HEAT_WRITE] = "\e[0;97;48;5;52m",
+	[ATTR_HEAT_WRITE + 1] = "\e[0;97;48;5;88m",
+	[ATTR_HEAT_WRITE + 2] = "\e[0;97;48;5;160m",
+	[ATTR_HEAT_WRITE + 3] = "\e[0;30;48;5;208m",
+};
+
+/* What the terminal shows, and the frame being built */
+static cell_t shown_cells[SCREEN_ROWS][SCREEN_COLS];
+static cell_t next_cells[SCREEN_ROWS][SCREEN_COLS];
+static bool_t screen_valid = 0;
+
+static char output_buffer[OUTPUT_BUFFER_SIZE];
+static uint32_t output_size = 0;
+
+static const char hex_digits[] = "0123456789ABCDEF";
 
 static u13_t editor_cursor = 0x0;
 static struct termios orig_termios;
@@ -54,6 +129,9 @@ void mem_edit_configure_terminal(void)
 	atexit(mem_edit_reset_terminal);
 	cfmakeraw(&new_termios);
 	tcsetattr(0, TCSANOW, &new_termios);
+
+	/* The whole editor is drawn on the next update */
+	screen_valid = 0;
 }
 
 static int kbhit()
@@ -79,95 +157,265 @@ static int getch()
 	}
 }
 
-static void print_editor_field(char *name, u32_t val, uint8_t depth, u12_t position)
+static void output_append(const char *str)
+{
+	size_t len = strlen(str);
+
+	memcpy(output_buffer + output_size, str, len);
+	output_size += len;
+}
+
+static void output_move(uint32_t row, uint32_t col)
+{
+	output_size += sprintf(output_buffer + output_size, "\e[%u;%uH", row + 1, col + 1);
+}
+
+static void output_write(void)
+{
+	char *data = output_buffer;
+	ssize_t n;
+
+	/* Whatever was printed before must not end up in the middle */
+	fflush(stdout);
+
+	while (output_size > 0) {
+		n = write(1, data, output_size);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			break;
+		}
+
+		data += n;
+		output_size -= n;
+	}
+
+	output_size = 0;
+}
+
+static uint32_t put_text(uint32_t row, uint32_t col, attr_t attr, const char *text)
+{
+	for (; *text != '\0' && col < SCREEN_COLS; text++, col++) {
+		next_cells[row][col] = (cell_t) { *text, attr };
+	}
+
+	return col;
+}
+
+static uint32_t put_digit(uint32_t row, uint32_t col, attr_t attr, u4_t val)
+{
+	char digit[2] = { hex_digits[val & 0xF], '\0' };
+
+	return put_text(row, col, attr, digit);
+}
+
+static uint32_t put_editor_field(uint32_t col, char *name, u32_t val, uint8_t depth, u12_t position)
 {
 	u12_t i;
 
-	printf("\e[1;34m%s:\e[0m 0x", name);
+	col = put_text(VARIABLES_ROW, col, ATTR_LABEL, name);
+	col = put_text(VARIABLES_ROW, col, ATTR_LABEL, ":");
+	col = put_text(VARIABLES_ROW, col, ATTR_NONE, " 0x");
 	for (i = 0; i < depth; i++) {
-		if (i + MEMORY_SIZE + position == editor_cursor) {
-			printf("\e[0;30;42m");
-		}
+		col = put_digit(VARIABLES_ROW, col, (i + MEMORY_SIZE + position == editor_cursor) ? ATTR_CURSOR : ATTR_NONE,
+				val >> (4 * (depth - 1 - i)));
+	}
+
+	return put_text(VARIABLES_ROW, col, ATTR_NONE, "    ");
+}
+
+static attr_t memory_attr(u12_t i)
+{
+	uint8_t level;
 
-		printf("%X", (val >> (4 * (depth - 1 - i))) & 0xF);
+	if (i == editor_cursor) {
+		return ATTR_CURSOR;
+	}
+
+	/* The heatmap overlays the memory regions */
+	if (heatmap_is_enabled()) {
+		switch (heatmap_get(i, &level)) {
+			case HEAT_READ:
+				return ATTR_HEAT_READ + level;
+
+			case HEAT_WRITE:
+				return ATTR_HEAT_WRITE + level;
 
-		if (i + MEMORY_SIZE + position == editor_cursor) {
-			printf("\e[0m");
+			default:
+				break;
 		}
 	}
+
+	if (i < 0x280) {
+		/* RAM */
+		return ATTR_NONE;
+	} else if (i >= 0xE00 && i < 0xE50) {
+		/* Display Memory 1 */
+		return ATTR_DISPLAY1;
+	} else if (i >= 0xE80 && i < 0xED0) {
+		/* Display Memory 2 */
+		return ATTR_DISPLAY2;
+	} else if (i >= 0xF00 && i < 0xF80) {
+		/* I/O Memory */
+		return ATTR_IO;
+	}
+
+	return ATTR_INVALID;
 }
 
-void mem_edit_update(void)
+static void build_screen(state_t *state)
 {
+	trace_entry_t entry;
+	char text[24];
+	uint32_t row, col;
 	u12_t i;
-	uint8_t key;
-	state_t *state = tamalib_get_state();
-	int8_t hbyte = -1;
 
-	/* Clear the console */
-	printf("\e[1;1H\e[2J");
+	for (row = 0; row < SCREEN_ROWS; row++) {
+		for (col = 0; col < SCREEN_COLS; col++) {
+			next_cells[row][col] = (cell_t) { ' ', ATTR_NONE };
+		}
+	}
 
 	/* Memory */
 	for (i = 0; i < MEMORY_SIZE; i++) {
+		row = MEMORY_ROW + i / 0x80;
 		if (!(i % 0x80)) {
-			printf("\r\n\e[1;34m0x%03X:\e[0m ", i);
+			snprintf(text, sizeof(text), "0x%03X:", i);
+			col = put_text(row, 0, ATTR_LABEL, text);
+			col = put_text(row, col, ATTR_NONE, " ");
 		}
 
-		if (i == editor_cursor) {
-			printf("\e[0;30;42m");
-		} else if (i < 0x280) {
-			/* RAM */
-		} else if (i >= 0xE00 && i < 0xE50) {
-			/* Display Memory 1 */
-			printf("\e[0;35m");
-		} else if (i >= 0xE80 && i < 0xED0) {
-			/* Display Memory 2 */
-			printf("\e[0;36m");
-		} else if (i >= 0xF00 && i < 0xF80) {
-			/* I/O Memory */
-			printf("\e[0;33m");
+		col = put_digit(row, col, memory_attr(i), state->memory[i]);
+	}
+
+	/* Variables */
+	col = put_editor_field(0, "PC", *(state->pc), 4, 0);
+	col = put_editor_field(col, "SP", *(state->sp), 2, 4);
+	col = put_editor_field(col, "NP", *(state->np), 2, 6);
+	col = put_editor_field(col, "X", *(state->x), 3, 8);
+	col = put_editor_field(col, "Y", *(state->y), 3, 11);
+	col = put_editor_field(col, "A", *(state->a), 1, 14);
+	col = put_editor_field(col, "B", *(state->b), 1, 15);
+	put_editor_field(col, "F", *(state->flags), 1, 16);
+
+	/* Cursor position */
+	col = put_text(CURSOR_ROW, 0, ATTR_TITLE, "Cursor:");
+	if (editor_cursor < MEMORY_SIZE) {
+		snprintf(text, sizeof(text), " 0x%04X", editor_cursor);
+		col = put_text(CURSOR_ROW, col, ATTR_NONE, text);
+	} else {
+		col = put_text(CURSOR_ROW, col, ATTR_NONE, " Variable");
+	}
+
+	col = put_text(CURSOR_ROW, col, ATTR_NONE, "    [ ");
+	col = put_text(CURSOR_ROW, col, ATTR_LEGEND_RAM, "RAM");
+	col = put_text(CURSOR_ROW, col, ATTR_NONE, "    ");
+	col = put_text(CURSOR_ROW, col, ATTR_LEGEND_DISPLAY1, "Display 1");
+	col = put_text(CURSOR_ROW, col, ATTR_NONE, "    ");
+	col = put_text(CURSOR_ROW, col, ATTR_LEGEND_DISPLAY2, "Display 2");
+	col = put_text(CURSOR_ROW, col, ATTR_NONE, "    ");
+	col = put_text(CURSOR_ROW, col, ATTR_LEGEND_IO, "I/O");
+	col = put_text(CURSOR_ROW, col, ATTR_NONE, "    ");
+	col = put_text(CURSOR_ROW, col, ATTR_LEGEND_INVALID, "Invalid");
+	col = put_text(CURSOR_ROW, col, ATTR_NONE, " ]");
+
+	if (heatmap_is_enabled()) {
+		col = put_text(CURSOR_ROW, col, ATTR_NONE, "    [ ");
+		col = put_text(CURSOR_ROW, col, ATTR_HEAT_READ + HEATMAP_LEVELS - 1, "Reads");
+		col = put_text(CURSOR_ROW, col, ATTR_NONE, "    ");
+		col = put_text(CURSOR_ROW, col, ATTR_HEAT_WRITE + HEATMAP_LEVELS - 1, "Writes");
+		put_text(CURSOR_ROW, col, ATTR_NONE, " ]");
+	}
+
+	/* Who last wrote the address under the cursor */
+	if (trace_is_enabled() && editor_cursor < MEMORY_SIZE) {
+		col = put_text(TRACE_ROW, 0, ATTR_TITLE, "Last write:");
+		if (trace_last_write(editor_cursor, &entry)) {
+			put_text(TRACE_ROW, col, ATTR_NONE, " None");
 		} else {
-			printf("\e[0;90m");
+			snprintf(text, sizeof(text), " PC 0x%04X", entry.pc);
+			col = put_text(TRACE_ROW, col, ATTR_NONE, text);
+			snprintf(text, sizeof(text), "    0x%X -> 0x%X", entry.old_value, entry.new_value);
+			col = put_text(TRACE_ROW, col, ATTR_NONE, text);
+			snprintf(text, sizeof(text), "    tick 0x%08X", entry.tick);
+			put_text(TRACE_ROW, col, ATTR_NONE, text);
 		}
+	}
+}
 
-		printf("%X", state->memory[i]);
-
-		if (i == editor_cursor) {
-			printf("\e[0m");
+/* Only the cells that changed since the previous frame are sent to the
+ * terminal, at once
+ */
+static void flush_screen(void)
+{
+	uint32_t row, col;
+	uint32_t cur_row = SCREEN_ROWS, cur_col = 0;
+	uint8_t cur_attr = ATTR_NUM;
+	cell_t *next, *shown;
+
+	if (!screen_valid) {
+		/* Clear the console */
+		output_append("\e[0m\e[1;1H\e[2J");
+		cur_attr = ATTR_NONE;
+
+		for (row = 0; row < SCREEN_ROWS; row++) {
+			for (col = 0; col < SCREEN_COLS; col++) {
+				shown_cells[row][col] = (cell_t) { ' ', ATTR_NONE };
+			}
 		}
+
+		screen_valid = 1;
 	}
 
-	printf("\r\n");
-	printf("\r\n");
+	for (row = 0; row < SCREEN_ROWS; row++) {
+		for (col = 0; col < SCREEN_COLS; col++) {
+			next = &next_cells[row][col];
+			shown = &shown_cells[row][col];
+			if (next->c == shown->c && next->attr == shown->attr) {
+				continue;
+			}
 
-	/* Variables */
-	print_editor_field("PC", *(state->pc), 4, 0);
-	printf("    ");
-	print_editor_field("SP", *(state->sp), 2, 4);
-	printf("    ");
-	print_editor_field("NP", *(state->np), 2, 6);
-	printf("    ");
-	print_editor_field("X", *(state->x), 3, 8);
-	printf("    ");
-	print_editor_field("Y", *(state->y), 3, 11);
-	printf("    ");
-	print_editor_field("A", *(state->a), 1, 14);
-	printf("    ");
-	print_editor_field("B", *(state->b), 1, 15);
-	printf("    ");
-	print_editor_field("F", *(state->flags), 1, 16);
-	printf("\r\n");
-
-	printf("\r\n");
+			if (row != cur_row || col != cur_col) {
+				output_move(row, col);
+			}
 
-	/* Cursor position */
-	if (editor_cursor < MEMORY_SIZE) {
-		printf("\e[1;32mCursor:\e[0m 0x%04X", editor_cursor);
-	} else {
-		printf("\e[1;32mCursor:\e[0m Variable");
+			if (next->attr != cur_attr) {
+				output_append(attr_codes[next->attr]);
+				cur_attr = next->attr;
+			}
+
+			output_buffer[output_size++] = next->c;
+			*shown = *next;
+
+			cur_row = row;
+			cur_col = col + 1;
+		}
+	}
+
+	if (output_size > 0) {
+		/* Leave the cursor below the editor */
+		if (cur_attr != ATTR_NONE) {
+			output_append(attr_codes[ATTR_NONE]);
+		}
+		output_move(SCREEN_ROWS, 0);
+		output_write();
 	}
+}
 
-	printf("    [ \e[1;37mRAM\e[0m    \e[1;35mDisplay 1\e[0m    \e[1;36mDisplay 2\e[0m    \e[1;33mI/O\e[0m    \e[1;90mInvalid\e[0m ]\r\n");
+void mem_edit_update(void)
+{
+	uint8_t key;
+	state_t *state = tamalib_get_state();
+	int8_t hbyte = -1;
+
+	build_screen(state);
+	flush_screen();
+
+	if (heatmap_is_enabled()) {
+		heatmap_decay();
+	}
 
 	while (kbhit()) {
 		key = getch();
@@ -234,6 +482,8 @@ void mem_edit_update(void)
 			if (editor_cursor < MEMORY_SIZE) {
 				/* Memory */
 				state->memory[editor_cursor] = hbyte;
+				shadow_set(editor_cursor, hbyte);
+				lcd_invalidate();
 			} else {
 				/* Variables */
 				if ((editor_cursor & 0xFFF) < 4) {
@@ -0,0 +1,401 @@
+/*
+ * TamaTool - A cross-platform Tamagotchi P1 explorer
+ *
+ * Copyright (C) 2021 Jean-Christophe Rona <jc@rona.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "SDL.h"
+
+#include "lib/tamalib.h"
+
+#include "record.h"
+#include "state.h"
+#include "lcd.h"
+#include "crc32.h"
+
+#define RECORD_SAMPLE_RATE		64 // Hz, in emulated time
+#define RECORD_FRAMERATE		30 // fps, for the constant framerate formats (Y4M, PBM)
+#define RECORD_PIXEL_SCALE		4
+
+#define RECORD_WIDTH			(LCD_WIDTH * RECORD_PIXEL_SCALE)
+#define RECORD_HEIGHT			(LCD_HEIGHT * RECORD_PIXEL_SCALE)
+
+#define Y4M_LUMA_ON			16
+#define Y4M_LUMA_OFF			235
+#define Y4M_CHROMA			128
+
+#define DEFLATE_STORED_MAX		65535
+
+typedef enum {
+	RECORD_FORMAT_Y4M,
+	RECORD_FORMAT_PBM,
+	RECORD_FORMAT_APNG,
+} record_format_t;
+
+typedef struct {
+	uint64_t ticks; // Emulated time since the beginning of the recording
+	lcd_frame_t frame;
+} record_entry_t;
+
+static char record_path[256];
+static record_format_t record_format;
+static bool_t is_recording = 0;
+static bool_t is_capturing = 0; // Cleared if the memory runs out, the frames captured so far are still exported
+
+static record_entry_t *entries = NULL;
+static uint32_t entry_num = 0;
+static uint32_t entry_max = 0;
+
+static uint64_t start_ticks;
+static uint64_t sample_ticks;
+static uint32_t last_generation;
+
+
+static bool_t ends_with(char *str, char *suffix)
+{
+	size_t str_len = strlen(str);
+	size_t suffix_len = strlen(suffix);
+
+	return (str_len >= suffix_len) && !SDL_strcasecmp(str + str_len - suffix_len, suffix);
+}
+
+bool_t record_start(char *path)
+{
+	if (ends_with(path, ".y4m")) {
+		record_format = RECORD_FORMAT_Y4M;
+	} else if (ends_with(path, ".pbm")) {
+		record_format = RECORD_FORMAT_PBM;
+	} else if (ends_with(path, ".png") || ends_with(path, ".apng")) {
+		record_format = RECORD_FORMAT_APNG;
+	} else {
+		fprintf(stderr, "FATAL: Unsupported recording format for \"%s\" (expected .y4m, .pbm or .png) !\n", path);
+		return 1;
+	}
+
+	strncpy(record_path, path, sizeof(record_path) - 1);
+	record_path[sizeof(record_path) - 1] = '\0';
+
+	entry_num = 0;
+	is_recording = 1;
+	is_capturing = 1;
+
+	/* The first poll captures the current frame and sets the time origin */
+	start_ticks = sample_ticks = UINT64_MAX;
+	last_generation = lcd_get_generation() - 1;
+
+	return 0;
+}
+
+/* Called as often as possible with the current emulated time (in ticks).
+ * The frame is sampled at RECORD_SAMPLE_RATE and stored only if it changed.
+ */
+void record_poll(uint64_t ticks)
+{
+	record_entry_t *new_entries;
+
+	if (!is_capturing) {
+		return;
+	}
+
+	if (start_ticks == UINT64_MAX) {
+		start_ticks = sample_ticks = ticks;
+	} else if (ticks - sample_ticks < EMU_TICK_FREQUENCY/RECORD_SAMPLE_RATE) {
+		return;
+	}
+
+	sample_ticks = ticks;
+
+	lcd_commit();
+	if (lcd_get_generation() == last_generation) {
+		return;
+	}
+
+	last_generation = lcd_get_generation();
+
+	if (entry_num >= entry_max) {
+		entry_max = (entry_max > 0) ? entry_max * 2 : 1024;
+		new_entries = (record_entry_t *) SDL_realloc(entries, entry_max * sizeof(record_entry_t));
+		if (new_entries == NULL) {
+			fprintf(stderr, "FATAL: Cannot allocate recording memory, stopping the recording !\n");
+			entry_max = entry_num;
+			is_capturing = 0;
+			return;
+		}
+
+		entries = new_entries;
+	}
+
+	entries[entry_num].ticks = ticks - start_ticks;
+	memcpy(&(entries[entry_num].frame), lcd_get_frame(), sizeof(lcd_frame_t));
+	entry_num++;
+}
+
+static void write_u32_be(uint8_t *buf, uint32_t v)
+{
+	buf[0] = (v >> 24) & 0xFF;
+	buf[1] = (v >> 16) & 0xFF;
+	buf[2] = (v >> 8) & 0xFF;
+	buf[3] = v & 0xFF;
+}
+
+static void write_u16_be(uint8_t *buf, uint16_t v)
+{
+	buf[0] = (v >> 8) & 0xFF;
+	buf[1] = v & 0xFF;
+}
+
+/* Scale a frame to RECORD_WIDTH x RECORD_HEIGHT, one byte per pixel (1 = on) */
+static void render_frame(const lcd_frame_t *frame, uint8_t *pixels)
+{
+	uint32_t x, y;
+
+	for (y = 0; y < RECORD_HEIGHT; y++) {
+		for (x = 0; x < RECORD_WIDTH; x++) {
+			pixels[y * RECORD_WIDTH + x] = LCD_FRAME_PIXEL(frame, x / RECORD_PIXEL_SCALE, y / RECORD_PIXEL_SCALE);
+		}
+	}
+}
+
+/* Pack a rendered frame as 1-bit rows, MSB first, with bit set to
+ * on_bit when the pixel is on
+ */
+static void pack_frame(const uint8_t *pixels, uint8_t *packed, uint32_t stride, uint8_t on_bit, uint32_t row_offset)
+{
+	uint32_t x, y;
+	uint8_t *row;
+
+	for (y = 0; y < RECORD_HEIGHT; y++) {
+		row = packed + y * stride + row_offset;
+		memset(row, on_bit ? 0x00 : 0xFF, (RECORD_WIDTH + 7)/8);
+
+		for (x = 0; x < RECORD_WIDTH; x++) {
+			if (pixels[y * RECORD_WIDTH + x]) {
+				row[x/8] ^= 0x80 >> (x % 8);
+			}
+		}
+	}
+}
+
+static void export_cfr(FILE *fp)
+{
+	uint8_t pixels[RECORD_WIDTH * RECORD_HEIGHT];
+	uint8_t packed[((RECORD_WIDTH + 7)/8) * RECORD_HEIGHT];
+	uint8_t chroma[(RECORD_WIDTH/2) * (RECORD_HEIGHT/2)];
+	uint64_t duration, t;
+	uint32_t frame_num, k, i = 0, p;
+
+	/* Resample the frames (timestamped in emulated time) at a constant framerate */
+	duration = entries[entry_num - 1].ticks + EMU_TICK_FREQUENCY/RECORD_FRAMERATE;
+	frame_num = (duration * RECORD_FRAMERATE) / EMU_TICK_FREQUENCY;
+
+	if (record_format == RECORD_FORMAT_Y4M) {
+		fprintf(fp, "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 C420jpeg\n", RECORD_WIDTH, RECORD_HEIGHT, RECORD_FRAMERATE);
+		memset(chroma, Y4M_CHROMA, sizeof(chroma));
+	}
+
+	for (k = 0; k < frame_num; k++) {
+		t = ((uint64_t) k * EMU_TICK_FREQUENCY) / RECORD_FRAMERATE;
+		while (i + 1 < entry_num && entries[i + 1].ticks <= t) {
+			i++;
+		}
+
+		render_frame(&(entries[i].frame), pixels);
+
+		if (record_format == RECORD_FORMAT_Y4M) {
+			for (p = 0; p < sizeof(pixels); p++) {
+				pixels[p] = pixels[p] ? Y4M_LUMA_ON : Y4M_LUMA_OFF;
+			}
+
+			fprintf(fp, "FRAME\n");
+			fwrite(pixels, 1, sizeof(pixels), fp);
+			fwrite(chroma, 1, sizeof(chroma), fp);
+			fwrite(chroma, 1, sizeof(chroma), fp);
+		} else {
+			/* Raw PBM, 1 is black */
+			pack_frame(pixels, packed, (RECORD_WIDTH + 7)/8, 1, 0);
+
+			fprintf(fp, "P4\n%u %u\n", RECORD_WIDTH, RECORD_HEIGHT);
+			fwrite(packed, 1, sizeof(packed), fp);
+		}
+	}
+}
+
+static void write_png_chunk(FILE *fp, const char *type, const uint8_t *data, uint32_t len)
+{
+	uint8_t buf[4];
+	uint32_t crc;
+
+	write_u32_be(buf, len);
+	fwrite(buf, 1, 4, fp);
+	fwrite(type, 1, 4, fp);
+	fwrite(data, 1, len, fp);
+
+	crc = crc32_update(0, (const uint8_t *) type, 4);
+	crc = crc32_update(crc, data, len);
+	write_u32_be(buf, crc);
+	fwrite(buf, 1, 4, fp);
+}
+
+/* Wrap raw data in a zlib stream made of stored (uncompressed) deflate blocks */
+static uint32_t zlib_store(const uint8_t *src, uint32_t len, uint8_t *dst)
+{
+	uint32_t a = 1, b = 0, i, block, pos = 0;
+
+	dst[pos++] = 0x78;
+	dst[pos++] = 0x01;
+
+	do {
+		block = (len > DEFLATE_STORED_MAX) ? DEFLATE_STORED_MAX : len;
+
+		dst[pos++] = (block == len) ? 1 : 0; // BFINAL, BTYPE = 00
+		dst[pos++] = block & 0xFF;
+		dst[pos++] = (block >> 8) & 0xFF;
+		dst[pos++] = ~block & 0xFF;
+		dst[pos++] = (~block >> 8) & 0xFF;
+
+		for (i = 0; i < block; i++) {
+			a = (a + src[i]) % 65521;
+			b = (b + a) % 65521;
+		}
+
+		memcpy(dst + pos, src, block);
+		pos += block;
+		src += block;
+		len -= block;
+	} while (len > 0);
+
+	write_u32_be(dst + pos, (b << 16) | a);
+	pos += 4;
+
+	return pos;
+}
+
+/* libpng has no APNG support, so the chunks are written directly */
+static void export_apng(FILE *fp)
+{
+	static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+	uint8_t pixels[RECORD_WIDTH * RECORD_HEIGHT];
+	uint8_t raw[((RECORD_WIDTH + 7)/8 + 1) * RECORD_HEIGHT];
+	uint8_t data[4 + sizeof(raw) + 2 + 5 * (sizeof(raw)/DEFLATE_STORED_MAX + 1) + 4];
+	uint8_t chunk[26];
+	uint32_t i, y, seq = 0, len;
+	uint64_t delay;
+	uint16_t delay_den;
+
+	fwrite(signature, 1, sizeof(signature), fp);
+
+	/* 1-bit grayscale */
+	write_u32_be(chunk, RECORD_WIDTH);
+	write_u32_be(chunk + 4, RECORD_HEIGHT);
+	chunk[8] = 1;
+	chunk[9] = 0;
+	chunk[10] = 0;
+	chunk[11] = 0;
+	chunk[12] = 0;
+	write_png_chunk(fp, "IHDR", chunk, 13);
+
+	write_u32_be(chunk, entry_num);
+	write_u32_be(chunk + 4, 0); // Loop forever
+	write_png_chunk(fp, "acTL", chunk, 8);
+
+	for (i = 0; i < entry_num; i++) {
+		/* Each frame lasts until the next one (the last one lasts one sample) */
+		if (i + 1 < entry_num) {
+			delay = entries[i + 1].ticks - entries[i].ticks;
+		} else {
+			delay = EMU_TICK_FREQUENCY/RECORD_SAMPLE_RATE;
+		}
+
+		delay = (delay * 1000) / EMU_TICK_FREQUENCY;
+		delay_den = 1000;
+		if (delay > 0xFFFF) {
+			delay /= 100;
+			delay_den = 10;
+		}
+		if (delay > 0xFFFF) {
+			delay = 0xFFFF;
+		}
+
+		write_u32_be(chunk, seq++);
+		write_u32_be(chunk + 4, RECORD_WIDTH);
+		write_u32_be(chunk + 8, RECORD_HEIGHT);
+		write_u32_be(chunk + 12, 0);
+		write_u32_be(chunk + 16, 0);
+		write_u16_be(chunk + 20, delay);
+		write_u16_be(chunk + 22, delay_den);
+		chunk[24] = 0; // APNG_DISPOSE_OP_NONE
+		chunk[25] = 0; // APNG_BLEND_OP_SOURCE
+		write_png_chunk(fp, "fcTL", chunk, 26);
+
+		/* PNG rows are prefixed with their filter type (0, none), 1 is white */
+		render_frame(&(entries[i].frame), pixels);
+		pack_frame(pixels, raw, (RECORD_WIDTH + 7)/8 + 1, 0, 1);
+		for (y = 0; y < RECORD_HEIGHT; y++) {
+			raw[y * ((RECORD_WIDTH + 7)/8 + 1)] = 0;
+		}
+
+		if (i == 0) {
+			len = zlib_store(raw, sizeof(raw), data);
+			write_png_chunk(fp, "IDAT", data, len);
+		} else {
+			write_u32_be(data, seq++);
+			len = zlib_store(raw, sizeof(raw), data + 4);
+			write_png_chunk(fp, "fdAT", data, len + 4);
+		}
+	}
+
+	write_png_chunk(fp, "IEND", NULL, 0);
+}
+
+/* Stop the recording and export the captured frames */
+void record_stop(void)
+{
+	FILE *fp;
+
+	if (!is_recording) {
+		return;
+	}
+
+	is_recording = 0;
+	is_capturing = 0;
+
+	if (entry_num == 0) {
+		fprintf(stderr, "No frame recorded, \"%s\" not written\n", record_path);
+		return;
+	}
+
+	fp = fopen(record_path, "wb");
+	if (!fp) {
+		fprintf(stderr, "FATAL: Cannot create recording file \"%s\" !\n", record_path);
+	} else {
+		if (record_format == RECORD_FORMAT_APNG) {
+			export_apng(fp);
+		} else {
+			export_cfr(fp);
+		}
+
+		fclose(fp);
+	}
+
+	SDL_free(entries);
+	entries = NULL;
+	entry_num = entry_max = 0;
+}
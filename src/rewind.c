@@ -0,0 +1,210 @@
+/*
+ * TamaTool - A cross-platform Tamagotchi P1 explorer
+ *
+ * Copyright (C) 2021 Jean-Christophe Rona <jc@rona.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "lib/tamalib.h"
+
+#include "rewind.h"
+#include "state.h"
+
+#define REWIND_INTERVAL			(EMU_TICK_FREQUENCY / 2) // Emulated time between snapshots
+#define REWIND_BUFFER_SIZE		(1024 * 1024) // Bytes available for the deltas
+#define REWIND_MAX_DELTAS		4096
+
+/* Unchanged nibbles between two changed ones are stored as well when the gap
+ * is shorter than a run header
+ */
+#define RUN_HEADER_SIZE			4
+#define REGS_SIZE			offsetof(state_snapshot_t, memory)
+#define DELTA_MAX_SIZE			(REGS_SIZE + MEMORY_SIZE + RUN_HEADER_SIZE * (MEMORY_SIZE / (RUN_HEADER_SIZE + 1) + 1))
+
+typedef struct {
+	uint32_t offset;
+	uint32_t size;
+} delta_t;
+
+/* Only the latest snapshot is kept in full. Each older one is stored as
+ * a backward delta (registers, plus the memory runs that differ) from the
+ * following one, in a ring buffer that drops the oldest deltas when full.
+ */
+static state_snapshot_t latest;
+static state_snapshot_t current;
+static bool_t has_latest = 0;
+static uint64_t latest_ticks;
+
+static uint8_t buffer[REWIND_BUFFER_SIZE];
+static uint8_t scratch[DELTA_MAX_SIZE];
+static delta_t deltas[REWIND_MAX_DELTAS];
+static uint32_t delta_first = 0; // Oldest
+static uint32_t delta_num = 0;
+
+
+/* Encodes what is needed to go back from snapshot to, to snapshot from */
+static uint32_t encode_delta(state_snapshot_t *from, state_snapshot_t *to, uint8_t *data)
+{
+	uint32_t size = REGS_SIZE;
+	uint32_t i = 0, start, end, gap;
+
+	memcpy(data, from, REGS_SIZE);
+
+	while (i < MEMORY_SIZE) {
+		if (from->memory[i] == to->memory[i]) {
+			i++;
+			continue;
+		}
+
+		start = end = i;
+		for (i = start + 1; i < MEMORY_SIZE; i++) {
+			if (from->memory[i] != to->memory[i]) {
+				end = i;
+			} else {
+				gap = i - end;
+				if (gap > RUN_HEADER_SIZE) {
+					break;
+				}
+			}
+		}
+
+		data[size++] = start & 0xFF;
+		data[size++] = start >> 8;
+		data[size++] = (end - start + 1) & 0xFF;
+		data[size++] = (end - start + 1) >> 8;
+		memcpy(data + size, from->memory + start, (end - start + 1));
+		size += end - start + 1;
+
+		i = end + 1;
+	}
+
+	return size;
+}
+
+static void apply_delta(state_snapshot_t *snap, uint8_t *data, uint32_t size)
+{
+	uint32_t pos = REGS_SIZE;
+	uint32_t start, len;
+
+	memcpy(snap, data, REGS_SIZE);
+
+	while (pos + RUN_HEADER_SIZE <= size) {
+		start = data[pos] | (data[pos + 1] << 8);
+		len = data[pos + 2] | (data[pos + 3] << 8);
+		pos += RUN_HEADER_SIZE;
+
+		memcpy(snap->memory + start, data + pos, len);
+		pos += len;
+	}
+}
+
+static void drop_oldest(void)
+{
+	delta_first = (delta_first + 1) % REWIND_MAX_DELTAS;
+	delta_num--;
+}
+
+static void push_delta(uint8_t *data, uint32_t size)
+{
+	delta_t *oldest, *newest;
+	uint32_t offset = 0;
+
+	if (delta_num == REWIND_MAX_DELTAS) {
+		drop_oldest();
+	}
+
+	if (delta_num > 0) {
+		newest = &deltas[(delta_first + delta_num - 1) % REWIND_MAX_DELTAS];
+		offset = newest->offset + newest->size;
+		if (offset + size > REWIND_BUFFER_SIZE) {
+			/* Wrap around, the end of the buffer is given up along
+			 * with the oldest deltas it holds
+			 */
+			while (delta_num > 0 && deltas[delta_first].offset >= offset) {
+				drop_oldest();
+			}
+
+			offset = 0;
+		}
+	}
+
+	/* Make room by dropping the oldest deltas overlapping the new one */
+	while (delta_num > 0) {
+		oldest = &deltas[delta_first];
+		if (oldest->offset >= offset + size || offset >= oldest->offset + oldest->size) {
+			break;
+		}
+
+		drop_oldest();
+	}
+
+	memcpy(buffer + offset, data, size);
+	deltas[(delta_first + delta_num) % REWIND_MAX_DELTAS] = (delta_t) { offset, size };
+	delta_num++;
+}
+
+void rewind_reset(void)
+{
+	has_latest = 0;
+	delta_first = delta_num = 0;
+}
+
+/* Called as often as possible with the current emulated time (in ticks).
+ * A snapshot is taken every REWIND_INTERVAL, without any allocation nor
+ * syscall.
+ */
+void rewind_poll(uint64_t ticks)
+{
+	if (has_latest && ticks - latest_ticks < REWIND_INTERVAL) {
+		return;
+	}
+
+	if (!has_latest) {
+		state_capture(&latest);
+		has_latest = 1;
+	} else {
+		state_capture(&current);
+		push_delta(scratch, encode_delta(&latest, &current, scratch));
+		memcpy(&latest, &current, sizeof(state_snapshot_t));
+	}
+
+	latest_ticks = ticks;
+}
+
+/* Restores the snapshot preceding the latest one, and forgets the latter.
+ * Returns 1 if there is nothing to go back to.
+ */
+bool_t rewind_step_back(void)
+{
+	delta_t *newest;
+
+	if (delta_num == 0) {
+		return 1;
+	}
+
+	newest = &deltas[(delta_first + delta_num - 1) % REWIND_MAX_DELTAS];
+	apply_delta(&latest, buffer + newest->offset, newest->size);
+	delta_num--;
+
+	state_restore(&latest);
+
+	return 0;
+}
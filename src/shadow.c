@@ -0,0 +1,53 @@
+/*
+ * TamaTool - A cross-platform Tamagotchi P1 explorer
+ *
+ * Copyright (C) 2021 Jean-Christophe Rona <jc@rona.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "shadow.h"
+
+/* Last value seen at each address by the memory hooks, a write being
+ * reported once the memory is already updated
+ */
+static u4_t shadow[MEMORY_SIZE];
+
+
+/* Takes the whole memory as reference, once it has been changed behind
+ * the emulation (state loading, rewinding)
+ */
+void shadow_sync(u4_t *memory)
+{
+	memcpy(shadow, memory, sizeof(shadow));
+}
+
+void shadow_set(u12_t addr, u4_t value)
+{
+	shadow[addr] = value;
+}
+
+/* Returns the previous value of addr */
+u4_t shadow_swap(u12_t addr, u4_t value)
+{
+	u4_t old_value = shadow[addr];
+
+	shadow[addr] = value;
+
+	return old_value;
+}
@@ -20,145 +20,780 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__WIN32__)
+#include <windows.h>
+#include <direct.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #include "SDL.h"
 
 #include "lib/tamalib.h"
 
 #include "state.h"
+#include "lcd.h"
+#include "crc32.h"
+#include "store.h"
 
 #define STATE_FILE_MAGIC				"TLST"
-#define STATE_FILE_VERSION				1
+#define STATE_FILE_VERSION				2
 
+/* Size of the v1 format: magic, version, registers and timers, interrupts and memory */
+#define STATE_V1_SIZE					(30 + INT_SLOT_NUM * 3 + MEMORY_SIZE)
 
-static uint32_t find_next_slot(void)
+/* The v2 format is made of a header (magic, version, number of sections),
+ * a section table (tag, offset, size and CRC32 of each section), and the
+ * sections themselves. Sections are written at fixed offsets, so that the
+ * memory can be copied at once from a mapped file.
+ */
+#define V2_HEADER_SIZE					8
+#define V2_SECTION_ENTRY_SIZE				16
+#define V2_MAX_SECTIONS					8
+#define V2_REGS_OFFSET					(V2_HEADER_SIZE + V2_MAX_SECTIONS * V2_SECTION_ENTRY_SIZE)
+#define V2_REGS_SIZE					15
+#define V2_TIMERS_OFFSET				(V2_REGS_OFFSET + 16)
+#define V2_TIMERS_SIZE					15
+#define V2_INTS_OFFSET					(V2_TIMERS_OFFSET + 16)
+#define V2_INTS_SIZE					(INT_SLOT_NUM * 3)
+#define V2_MEMORY_OFFSET				256 // Leaves room for up to 29 interrupt slots
+#define V2_MEMORY_SIZE					MEMORY_SIZE
+#define V2_LCD_OFFSET					(V2_MEMORY_OFFSET + V2_MEMORY_SIZE)
+#define V2_LCD_SIZE					(LCD_HEIGHT * 4 + 1)
+#define STATE_V2_SIZE					(V2_LCD_OFFSET + V2_LCD_SIZE)
+
+/* A delta state has the same registers, timers and interrupts sections,
+ * but references a base state (hash and path) instead of holding the
+ * memory, and only lists the memory runs that differ from it
+ */
+#define V2_BASE_OFFSET					V2_MEMORY_OFFSET
+#define V2_BASE_MAX_SIZE				(4 + 256)
+#define V2_RUN_HEADER_SIZE				4
+
+/* A state kept in the store is referenced by a file only holding the key of
+ * its object (and the path of the store). An object is the registers,
+ * timers and interrupts sections, followed by the keys of the memory
+ * blocks, each block being packed with two nibbles per byte.
+ */
+#define V2_STORE_REF_OFFSET				V2_REGS_OFFSET
+#define STORE_CORE_SIZE					(V2_MEMORY_OFFSET - V2_REGS_OFFSET)
+#define STORE_BLOCK_SIZE				128 // Nibbles
+#define STORE_BLOCKS					(MEMORY_SIZE / STORE_BLOCK_SIZE)
+#define STORE_OBJECT_SIZE				(STORE_CORE_SIZE + STORE_BLOCKS * 8)
+
+#define STATE_DELTA_MAX_CHAIN				16 // A full state is saved after this many deltas
+#define STATE_DELTA_MAX_DEPTH				64 // Guards against reference loops
+
+/* The small format can exceed the v1 one in the worst case (very short runs) */
+#define STATE_BUFFER_SIZE				(2 * STATE_V1_SIZE)
+
+typedef enum {
+	SECTION_REGS,
+	SECTION_TIMERS,
+	SECTION_INTERRUPTS,
+	SECTION_MEMORY,
+	SECTION_LCD, // Optional, for tools showing the screen without emulating
+	SECTION_BASE, // Delta only
+	SECTION_MEMORY_DELTA, // Delta only
+	SECTION_STORE_REF, // Store reference only
+	SECTION_NUM,
+} section_t;
+
+/* Variable size sections have a size of 0 */
+static const struct {
+	char tag[5];
+	uint32_t offset;
+	uint32_t size;
+	bool_t required;
+} sections[SECTION_NUM] = {
+	[SECTION_REGS] = {"REGS", V2_REGS_OFFSET, V2_REGS_SIZE, 1},
+	[SECTION_TIMERS] = {"TIMR", V2_TIMERS_OFFSET, V2_TIMERS_SIZE, 1},
+	[SECTION_INTERRUPTS] = {"INTS", V2_INTS_OFFSET, V2_INTS_SIZE, 1},
+	[SECTION_MEMORY] = {"MEMS", V2_MEMORY_OFFSET, V2_MEMORY_SIZE, 0},
+	[SECTION_LCD] = {"LCDF", V2_LCD_OFFSET, V2_LCD_SIZE, 0},
+	[SECTION_BASE] = {"BASE", V2_BASE_OFFSET, 0, 0},
+	[SECTION_MEMORY_DELTA] = {"MDIF", 0, 0, 0},
+	[SECTION_STORE_REF] = {"SREF", V2_STORE_REF_OFFSET, 0, 0},
+};
+
+typedef struct {
+	char format; // 'L'ong (v1 or v2), 'S'mall, 'D'elta or store 'R'eference
+	uint32_t depth; // Number of deltas applied on top of a full state
+} state_file_info_t;
+
+#define MANIFEST_LINE_MAX				64
+
+typedef struct {
+	uint32_t slot;
+	int64_t timestamp; // Unix time of the save
+	uint64_t ticks; // Emulated time of the save, accumulated over the sessions
+	char format; // Same as state_file_info_t
+} manifest_entry_t;
+
+/* Whole files are serialized to/parsed from this buffer, then written/read at once */
+static uint8_t state_buffer[STATE_BUFFER_SIZE];
+
+/* In-memory copy of the manifest, loaded on first use */
+static manifest_entry_t *manifest = NULL;
+static uint32_t manifest_num = 0;
+static uint32_t manifest_max = 0;
+static bool_t manifest_loaded = 0;
+static uint64_t manifest_base_ticks = 0; // Emulated time of the last save of the previous sessions
+
+/* Full states are saved to this store when set */
+static char store_path[256] = {0};
+
+/* Saves to the next slot only hold what changed since the last one */
+static bool_t delta_enabled = 0;
+
+
+static bool_t is_separator(char c)
+{
+#if defined(__WIN32__)
+	return c == '/' || c == '\\';
+#else
+	return c == '/';
+#endif
+}
+
+static bool_t is_absolute(char *path)
+{
+	return is_separator(path[0]) || (path[0] != '\0' && path[1] == ':');
+}
+
+/* Length of the directory part of path, trailing separator included */
+static uint32_t dir_length(char *path)
+{
+	uint32_t len = strlen(path);
+
+	while (len > 0 && !is_separator(path[len - 1])) {
+		len--;
+	}
+
+	return len;
+}
+
+/* Lexically drops the "." components and the directories followed by "..",
+ * so that equivalent paths compare equal
+ */
+static void normalize_path(char *path)
+{
+	uint32_t prefix = 0, len, i, start, comp_len, last;
+
+	if (is_absolute(path)) {
+		while (path[prefix] != '\0' && !is_separator(path[prefix])) {
+			prefix++;
+		}
+
+		if (path[prefix] != '\0') {
+			prefix++;
+		}
+	}
+
+	len = i = prefix;
+	while (path[i] != '\0') {
+		start = i;
+		while (path[i] != '\0' && !is_separator(path[i])) {
+			i++;
+		}
+
+		comp_len = i - start;
+		if (path[i] != '\0') {
+			i++;
+		}
+
+		if (comp_len == 0 || (comp_len == 1 && path[start] == '.')) {
+			continue;
+		}
+
+		if (comp_len == 2 && !strncmp(path + start, "..", 2) && len > prefix) {
+			/* The last kept component always ends with a separator */
+			last = len - 1;
+			while (last > prefix && !is_separator(path[last - 1])) {
+				last--;
+			}
+
+			if (len - 1 - last != 2 || strncmp(path + last, "..", 2)) {
+				len = last;
+				continue;
+			}
+		}
+
+		memmove(path + len, path + start, i - start);
+		len += i - start;
+	}
+
+	path[len] = '\0';
+}
+
+/* Paths stored in a state file (bases and stores) are relative to its
+ * directory: gives the path to open for the one stored in file
+ */
+static bool_t resolve_path(char *file, char *stored, char *path, uint32_t size)
+{
+	uint32_t dir_len = is_absolute(stored) ? 0 : dir_length(file);
+
+	if (dir_len + strlen(stored) + 1 > size) {
+		return 1;
+	}
+
+	memcpy(path, file, dir_len);
+	strcpy(path + dir_len, stored);
+	normalize_path(path);
+
+	return 0;
+}
+
+static bool_t absolute_path(char *path, char *abs, uint32_t size)
+{
+	char cwd[256];
+
+	if (is_absolute(path)) {
+		cwd[0] = '\0';
+#if defined(__WIN32__)
+	} else if (_getcwd(cwd, sizeof(cwd)) == NULL) {
+#else
+	} else if (getcwd(cwd, sizeof(cwd)) == NULL) {
+#endif
+		return 1;
+	}
+
+	if ((uint32_t) snprintf(abs, size, "%s%s%s", cwd, cwd[0] ? "/" : "", path) >= size) {
+		return 1;
+	}
+
+	normalize_path(abs);
+
+	return 0;
+}
+
+/* Inverse of resolve_path(): gives the path to store in file to refer to
+ * the given one
+ */
+static bool_t relative_path(char *file, char *path, char *stored, uint32_t size)
+{
+	uint32_t dir_len = dir_length(file);
+	uint32_t len = 0, common = 0, i, start;
+	bool_t absolute = is_absolute(file);
+	char *full_path = path;
+
+	if (is_absolute(path)) {
+		dir_len = 0;
+	}
+
+	/* Directories shared by both paths are skipped */
+	for (i = 0; i < dir_len && path[i] == file[i]; i++) {
+		if (is_separator(file[i])) {
+			common = i + 1;
+		}
+	}
+
+	path += common;
+
+	/* Then go up once per remaining component of the directory of file */
+	for (i = common; i < dir_len && !absolute; i = start + 1) {
+		start = i;
+		while (!is_separator(file[start])) {
+			start++;
+		}
+
+		if (start == i || (start - i == 1 && file[i] == '.')) {
+			continue;
+		}
+
+		/* No way back from a parent directory */
+		if (start - i == 2 && !strncmp(file + i, "..", 2)) {
+			absolute = 1;
+			break;
+		}
+
+		if (len + 3 >= size) {
+			return 1;
+		}
+
+		memcpy(stored + len, "../", 3);
+		len += 3;
+	}
+
+	/* Otherwise, the path is stored as an absolute one */
+	if (dir_len > 0 && absolute) {
+		return absolute_path(full_path, stored, size);
+	}
+
+	if (len + strlen(path) + 1 > size) {
+		return 1;
+	}
+
+	strcpy(stored + len, path);
+
+	return 0;
+}
+
+/* Atomically replaces path with tmp_path */
+static bool_t replace_file(char *tmp_path, char *path)
+{
+#if defined(__WIN32__)
+	return !MoveFileEx(tmp_path, path, MOVEFILE_REPLACE_EXISTING);
+#else
+	return rename(tmp_path, path) != 0;
+#endif
+}
+
+/* Waits for the data written to fp to reach the disk */
+static bool_t sync_file(FILE *fp)
+{
+	if (fflush(fp) != 0) {
+		return 1;
+	}
+
+#if defined(__WIN32__)
+	return !FlushFileBuffers((HANDLE) _get_osfhandle(_fileno(fp)));
+#else
+	return fsync(fileno(fp)) != 0;
+#endif
+}
+
+/* Waits for the entry of path in its directory to reach the disk, which
+ * Windows does along with the file
+ */
+static void sync_dir(char *path)
+{
+#if !defined(__WIN32__)
+	char dir_path[256];
+	uint32_t dir_len = dir_length(path);
+	int fd;
+
+	if (dir_len == 0) {
+		strcpy(dir_path, ".");
+	} else if (dir_len < sizeof(dir_path)) {
+		memcpy(dir_path, path, dir_len);
+		dir_path[dir_len] = '\0';
+	} else {
+		return;
+	}
+
+	fd = open(dir_path, O_RDONLY);
+	if (fd < 0) {
+		return;
+	}
+
+	fsync(fd);
+	close(fd);
+#endif
+}
+
+/* The whole file is written next to the previous one, synced, and then
+ * moved over it, so that an interrupted write (or a power loss) never
+ * leaves a corrupted file
+ */
+static bool_t write_file_atomic(char *path, uint8_t *data, uint32_t size)
+{
+	FILE *f;
+	char tmp_path[256 + sizeof(STATE_TMP_SUFFIX)];
+	bool_t failed;
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s"STATE_TMP_SUFFIX, path);
+
+	f = fopen(tmp_path, "wb");
+	if (f == NULL) {
+		fprintf(stderr, "FATAL: Cannot create file \"%s\" !\n", tmp_path);
+		return 1;
+	}
+
+	failed = (size > 0 && fwrite(data, size, 1, f) != 1);
+	failed |= sync_file(f);
+	failed |= (fclose(f) != 0);
+
+	if (failed) {
+		fprintf(stderr, "FATAL: Failed to write to file \"%s\" !\n", tmp_path);
+		remove(tmp_path);
+		return 1;
+	}
+
+	if (replace_file(tmp_path, path)) {
+		fprintf(stderr, "FATAL: Cannot replace file \"%s\" !\n", path);
+		remove(tmp_path);
+		return 1;
+	}
+
+	sync_dir(path);
+
+	return 0;
+}
+
+static bool_t manifest_add(manifest_entry_t *entry)
+{
+	manifest_entry_t *new_manifest;
+
+	if (manifest_num == manifest_max) {
+		manifest_max = (manifest_max > 0) ? manifest_max * 2 : 64;
+		new_manifest = SDL_realloc(manifest, manifest_max * sizeof(manifest_entry_t));
+		if (new_manifest == NULL) {
+			fprintf(stderr, "FATAL: Cannot allocate the save manifest !\n");
+			manifest_max = manifest_num;
+			return 1;
+		}
+
+		manifest = new_manifest;
+	}
+
+	manifest[manifest_num++] = *entry;
+
+	return 0;
+}
+
+static bool_t manifest_write(void)
 {
+	char *data;
+	uint32_t size = 0;
+	uint32_t i;
+	bool_t ret;
+
+	data = SDL_malloc((manifest_num + 1) * MANIFEST_LINE_MAX);
+	if (data == NULL) {
+		fprintf(stderr, "FATAL: Cannot allocate the save manifest !\n");
+		return 1;
+	}
+
+	size += snprintf(data + size, MANIFEST_LINE_MAX, "# slot timestamp ticks format\n");
+	for (i = 0; i < manifest_num; i++) {
+		size += snprintf(data + size, MANIFEST_LINE_MAX, "%u %lld %llu %c\n",
+				manifest[i].slot, (long long) manifest[i].timestamp, (unsigned long long) manifest[i].ticks, manifest[i].format);
+	}
+
+	ret = write_file_atomic(STATE_MANIFEST, (uint8_t *) data, size);
+
+	SDL_free(data);
+
+	return ret;
+}
+
+/* Saves only append their own line, so that their cost does not grow with
+ * the number of saves
+ */
+static bool_t manifest_append(manifest_entry_t *entry)
+{
+	FILE *fp;
+	bool_t failed;
+
+	fp = fopen(STATE_MANIFEST, "ab");
+	if (fp == NULL) {
+		fprintf(stderr, "FATAL: Cannot open file \"%s\" !\n", STATE_MANIFEST);
+		return 1;
+	}
+
+	failed = (fseek(fp, 0, SEEK_END) != 0);
+	if (!failed && ftell(fp) == 0) {
+		failed = (fprintf(fp, "# slot timestamp ticks format\n") < 0);
+	}
+
+	failed |= (fprintf(fp, "%u %lld %llu %c\n", entry->slot, (long long) entry->timestamp,
+				(unsigned long long) entry->ticks, entry->format) < 0);
+	failed |= sync_file(fp);
+	failed |= (fclose(fp) != 0);
+
+	if (failed) {
+		fprintf(stderr, "FATAL: Failed to write to file \"%s\" !\n", STATE_MANIFEST);
+	}
+
+	return failed;
+}
+
+/* Saves made before the manifest existed are found once by probing the
+ * slots, and recorded without timestamp
+ */
+static void manifest_rebuild(void)
+{
+	manifest_entry_t entry = {0};
 	char path[256];
-	uint32_t i = 0;
+	SDL_RWops *f;
+	uint8_t buf[2];
 
-	for (i = 0;; i++) {
-		sprintf(path, STATE_TEMPLATE, i);
-		if (!SDL_RWFromFile(path, "r")) {
+	for (entry.slot = 0;; entry.slot++) {
+		sprintf(path, STATE_TEMPLATE, entry.slot);
+		f = SDL_RWFromFile(path, "rb");
+		if (f == NULL) {
+			break;
+		}
+
+		/* The 14th bit tells whether this is a "small" format file */
+		entry.format = (SDL_RWread(f, buf, 2, 1) == 1 && (buf[1] & 0x20)) ? 'S' : 'L';
+		SDL_RWclose(f);
+
+		if (manifest_add(&entry)) {
 			break;
 		}
 	}
 
-	return i;
+	if (manifest_num > 0) {
+		manifest_write();
+	}
+}
+
+static void manifest_load(void)
+{
+	manifest_entry_t entry;
+	char line[MANIFEST_LINE_MAX];
+	long long timestamp;
+	unsigned long long ticks;
+	FILE *fp;
+
+	if (manifest_loaded) {
+		return;
+	}
+
+	manifest_loaded = 1;
+
+	fp = fopen(STATE_MANIFEST, "r");
+	if (fp == NULL) {
+		manifest_rebuild();
+		return;
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (line[0] == '#') {
+			continue;
+		}
+
+		if (sscanf(line, "%u %lld %llu %c", &entry.slot, &timestamp, &ticks, &entry.format) != 4) {
+			fprintf(stderr, "FATAL: Ignoring malformed line in \"%s\" !\n", STATE_MANIFEST);
+			continue;
+		}
+
+		entry.timestamp = timestamp;
+		entry.ticks = ticks;
+		if (manifest_add(&entry)) {
+			break;
+		}
+	}
+
+	fclose(fp);
+
+	if (manifest_num > 0) {
+		manifest_base_ticks = manifest[manifest_num - 1].ticks;
+	}
+}
+
+/* Returns 1 if path is the name of a save slot, and gets its number */
+static bool_t parse_slot(char *path, uint32_t *slot)
+{
+	char name[256];
+
+	if (sscanf(path, STATE_TEMPLATE, slot) != 1) {
+		return 0;
+	}
+
+	snprintf(name, sizeof(name), STATE_TEMPLATE, *slot);
+
+	return !strcmp(name, path);
+}
+
+/* ticks is the emulated time since the start of the session */
+static void manifest_record(char *path, char format, uint64_t ticks)
+{
+	manifest_entry_t entry;
+
+	if (!parse_slot(path, &entry.slot)) {
+		return;
+	}
+
+	manifest_load();
+
+	entry.timestamp = (int64_t) time(NULL);
+	entry.ticks = manifest_base_ticks + ticks;
+	entry.format = format;
+
+	if (!manifest_add(&entry)) {
+		manifest_append(&entry);
+	}
+}
+
+static void manifest_set_format(char *path, char format)
+{
+	uint32_t slot;
+	uint32_t i;
+
+	if (!parse_slot(path, &slot)) {
+		return;
+	}
+
+	manifest_load();
+
+	for (i = manifest_num; i > 0; i--) {
+		if (manifest[i - 1].slot == slot) {
+			manifest[i - 1].format = format;
+			manifest_write();
+			return;
+		}
+	}
 }
 
 void state_find_next_name(char *path)
 {
-	sprintf(path, STATE_TEMPLATE, find_next_slot());
+	manifest_load();
+
+	sprintf(path, STATE_TEMPLATE, (manifest_num > 0) ? manifest[manifest_num - 1].slot + 1 : 0);
 }
 
 void state_find_last_name(char *path)
 {
-	uint32_t num = find_next_slot();
+	manifest_load();
 
-	if (num > 0) {
-		sprintf(path, STATE_TEMPLATE, num - 1);
+	if (manifest_num > 0) {
+		sprintf(path, STATE_TEMPLATE, manifest[manifest_num - 1].slot);
 	} else {
 		path[0] = '\0';
 	}
 }
 
+/* Bits are stored LSB first. Both directions go through a 64-bit
+ * accumulator, so that the buffer is only touched once per byte.
+ */
 struct bit_state {
-	SDL_RWops *f;
-	uint8_t buf;
+	uint8_t *data;
+	uint32_t size;
+	uint32_t pos;
+	uint64_t acc;
 	uint8_t num_valid;
 	bool_t is_nonzero;
 	uint32_t digit_count;
 };
 
-static uint32_t read_bits(struct bit_state *s, uint8_t num_bits) {
-	uint32_t val = 0;
-	for (uint8_t j=0; num_bits > 0; j++, num_bits--) {
-		if (s->num_valid == 0) {
-			SDL_RWread(s->f, &(s->buf), 1, 1);
-			s->num_valid = 8;
+/* Small numbers are written as k ones and a zero, followed by the number
+ * minus small_base[k] on small_bits[k] bits
+ */
+#define SMALL_NUMBER_CODES		7
+
+static const uint32_t small_base[SMALL_NUMBER_CODES] = {0, 1, 3, 7, 23, 279, 65815};
+static const uint8_t small_bits[SMALL_NUMBER_CODES] = {0, 1, 2, 4, 8, 16, 32};
+
+static uint8_t count_trailing_zeros(uint64_t val) {
+#if defined(__GNUC__)
+	return (val == 0) ? 64 : __builtin_ctzll(val);
+#else
+	uint8_t n = 0;
+	for (; n < 64 && !(val & 1); n++, val >>= 1);
+	return n;
+#endif
+}
+
+static uint64_t low_bits(uint8_t num_bits) {
+	return (num_bits >= 64) ? ~0ULL : ((1ULL << num_bits) - 1);
+}
+
+static void refill_bits(struct bit_state *s) {
+	while (s->num_valid <= 56) {
+		if (s->pos < s->size) {
+			s->acc |= (uint64_t) s->data[s->pos] << s->num_valid;
 		}
-		val |= (s->buf & 1) << j;
-		s->buf >>= 1;
-		s->num_valid -= 1;
+		s->pos++;
+		s->num_valid += 8;
+	}
+}
+
+static uint32_t read_bits(struct bit_state *s, uint8_t num_bits) {
+	uint32_t val;
+	if (s->num_valid < num_bits) {
+		refill_bits(s);
 	}
+	val = s->acc & low_bits(num_bits);
+	s->acc >>= num_bits;
+	s->num_valid -= num_bits;
 	return val;
 }
 
 static uint32_t read_small_number(struct bit_state *s) {
-	uint32_t val = 0;
-	uint8_t count_bits = 0;
-	while (read_bits(s, 1) == 1) {
-		val += (1<<count_bits);
-		count_bits = (count_bits==0) ? 1 : (count_bits<<1);
+	uint8_t k;
+	if (s->num_valid < SMALL_NUMBER_CODES) {
+		refill_bits(s);
 	}
-	val += read_bits(s, count_bits);
-	return val;
+	k = count_trailing_zeros(~s->acc);
+	if (k >= SMALL_NUMBER_CODES) {
+		k = SMALL_NUMBER_CODES - 1; // Corrupted stream
+	}
+	read_bits(s, k + 1);
+	return small_base[k] + read_bits(s, small_bits[k]);
 }
 
-static uint32_t read_rle(struct bit_state *s, uint8_t num_bits) {
-	uint32_t val = 0;
-	for (uint8_t j=0; num_bits > 0; j++, num_bits--) {
+static uint64_t read_rle(struct bit_state *s, uint8_t num_bits) {
+	uint64_t val = 0;
+	uint8_t j = 0, run;
+	while (num_bits > 0) {
 		if (s->digit_count == 0) {
 			s->is_nonzero = !s->is_nonzero;
 			s->digit_count = read_small_number(s) + 1;
 		}
+		run = (s->digit_count < num_bits) ? s->digit_count : num_bits;
 		if (s->is_nonzero) {
-			val |= (1 << j);
+			val |= low_bits(run) << j;
 		}
-		s->digit_count--;
+		j += run;
+		num_bits -= run;
+		s->digit_count -= run;
 	}
 	return val;
 }
 
-static uint32_t read_rle_start(struct bit_state *s, uint8_t num_bits){
+static uint64_t read_rle_start(struct bit_state *s, uint8_t num_bits){
 	bool_t first_bit = read_bits(s, 1);
 	s->is_nonzero = !first_bit;
 	s->digit_count = 0;
 	return read_rle(s, num_bits);
 }
 
+/* Up to 32 bits at a time */
 static void write_bits(struct bit_state *s, uint32_t val, uint8_t num_bits) {
-	while (num_bits > 0) {
-		s->buf |= (val&1) << (s->num_valid);
-		s->num_valid += 1;
-		val >>= 1;
-		num_bits -= 1;
-		if (s->num_valid >= 8) {
-			SDL_RWwrite(s->f, &(s->buf), 1, 1);
-			s->buf = 0;
-			s->num_valid = 0;
+	s->acc |= ((uint64_t) val & low_bits(num_bits)) << s->num_valid;
+	s->num_valid += num_bits;
+	while (s->num_valid >= 32) {
+		if (s->pos + 4 <= s->size) {
+			s->data[s->pos] = s->acc & 0xFF;
+			s->data[s->pos + 1] = (s->acc >> 8) & 0xFF;
+			s->data[s->pos + 2] = (s->acc >> 16) & 0xFF;
+			s->data[s->pos + 3] = (s->acc >> 24) & 0xFF;
 		}
+		s->pos += 4;
+		s->acc >>= 32;
+		s->num_valid -= 32;
 	}
 }
 
 static void write_small_number(struct bit_state *s, uint32_t val) {
-	uint8_t count_bits = 0;
-	while (val >= (1<<count_bits)) {
-		val -= (1<<count_bits);
-		count_bits = (count_bits == 0) ? 1 : (count_bits << 1);
-		write_bits(s, 1, 1);
+	uint8_t k = SMALL_NUMBER_CODES - 1;
+	while (val < small_base[k]) {
+		k--;
 	}
-	write_bits(s, 0, 1);
-	// now use count_bits to represent the number.
-	write_bits(s, val, count_bits);
+	write_bits(s, (1 << k) - 1, k + 1); // k ones, then a zero
+	write_bits(s, val - small_base[k], small_bits[k]);
 }
 
-static void write_rle(struct bit_state *s, uint32_t val, uint8_t num_bits) {
+/* Runs are measured with count-trailing-zeros instead of bit by bit */
+static void write_rle(struct bit_state *s, uint64_t val, uint8_t num_bits) {
+	uint8_t run;
+	val &= low_bits(num_bits);
 	while (num_bits > 0) {
-		bool_t this_bit = (val & 1);
-		if (this_bit == s->is_nonzero) {
-			s->digit_count++;
-		} else {
-			write_small_number(s, s->digit_count-1);
-			s->is_nonzero = this_bit;
-			s->digit_count = 1;
+		run = count_trailing_zeros(s->is_nonzero ? ~val : val);
+		if (run >= num_bits) {
+			s->digit_count += num_bits;
+			return;
 		}
-		val >>= 1;
-		num_bits -= 1;
+		s->digit_count += run;
+		write_small_number(s, s->digit_count-1);
+		s->is_nonzero = !s->is_nonzero;
+		s->digit_count = 0;
+		val >>= run;
+		num_bits -= run;
 	}
 }
 
-static void write_rle_start(struct bit_state *s, uint32_t val, uint8_t num_bits) {
+static void write_rle_start(struct bit_state *s, uint64_t val, uint8_t num_bits) {
 	s->is_nonzero = (val & 1);
 	s->digit_count = 1;
 	write_bits(s, val, 1); // starting state
@@ -166,159 +801,378 @@ static void write_rle_start(struct bit_state *s, uint32_t val, uint8_t num_bits)
 }
 
 static void flush_bits(struct bit_state *s) {
-	if (s->num_valid > 0) {
-		write_bits(s, 0, 8); // flush last bits
+	uint8_t num_bytes = (s->num_valid + 7) / 8;
+	for (; num_bytes > 0; num_bytes--) {
+		if (s->pos < s->size) {
+			s->data[s->pos] = s->acc & 0xFF;
+		}
+		s->pos++;
+		s->acc >>= 8;
+	}
+	s->num_valid = 0;
+}
+
+static void write_rle_flush(struct bit_state *s) {
+	write_small_number(s, s->digit_count-1);
+	flush_bits(s);
+}
+
+static void put_le(uint8_t *data, uint32_t *pos, uint32_t val, uint8_t bytes)
+{
+	for (; bytes > 0; bytes--, val >>= 8) {
+		data[(*pos)++] = val & 0xFF;
+	}
+}
+
+static uint32_t get_le(uint8_t *data, uint32_t *pos, uint8_t bytes)
+{
+	uint32_t val = 0;
+	uint8_t j;
+
+	for (j = 0; j < bytes; j++) {
+		val |= data[(*pos)++] << (8 * j);
+	}
+
+	return val;
+}
+
+/* Returns the number of bytes serialized into data */
+static uint32_t serialize_small(state_snapshot_t *snap, uint8_t *data, uint32_t size)
+{
+	struct bit_state bs = { data, size, 0, 0, 0 };
+	uint32_t tick_base;
+	uint64_t word;
+	uint32_t i, j;
+
+	write_bits(&bs, snap->pc, 13);
+	write_bits(&bs, 1, 1); // This marks it as a "small" format file
+	write_rle_start(&bs, snap->x, 12);
+	write_rle(&bs, snap->y, 12);
+	write_rle(&bs, snap->a, 4);
+	write_rle(&bs, snap->b, 4);
+	write_rle(&bs, snap->np, 5);
+	write_rle(&bs, snap->sp, 8);
+	write_rle(&bs, snap->flags, 4);
+	tick_base = snap->tick_counter;
+	write_rle(&bs, tick_base - snap->clk_timer_timestamp, 32);
+	write_rle(&bs, tick_base - snap->prog_timer_timestamp, 32);
+	write_rle(&bs, snap->prog_timer_enabled, 1);
+	write_rle(&bs, snap->prog_timer_data, 8);
+	write_rle(&bs, snap->prog_timer_rld, 8);
+	write_rle(&bs, snap->call_depth, 32);
+	for (i = 0; i < INT_SLOT_NUM; i++) {
+		write_rle(&bs, snap->interrupts[i].factor_flag_reg, 4);
+		write_rle(&bs, snap->interrupts[i].mask_reg, 4);
+		write_rle(&bs, snap->interrupts[i].triggered, 1);
+	}
+	// Write out RAM; RLE-encode, 16 nibbles at a time
+	for (i = 0; i < MEMORY_SIZE; i += 16) {
+		word = 0;
+		for (j = 0; j < 16; j++) {
+			word |= (uint64_t) (snap->memory[i + j] & 0xF) << (4 * j);
+		}
+		write_rle(&bs, word, 64);
+	}
+	write_rle_flush(&bs);
+
+	return bs.pos;
+}
+
+/* Registers, timers and interrupts sections, common to full and delta states */
+static void serialize_v2_core(state_snapshot_t *snap, uint8_t *data)
+{
+	uint32_t pos;
+	uint32_t i;
+
+	memcpy(data, STATE_FILE_MAGIC, 4);
+	data[4] = STATE_FILE_VERSION;
+	data[5] = 0;
+
+	pos = V2_REGS_OFFSET;
+	put_le(data, &pos, snap->pc & 0x1FFF, 2);
+	put_le(data, &pos, snap->x & 0xFFF, 2);
+	put_le(data, &pos, snap->y & 0xFFF, 2);
+	data[pos++] = snap->a & 0xF;
+	data[pos++] = snap->b & 0xF;
+	data[pos++] = snap->np & 0x1F;
+	data[pos++] = snap->sp & 0xFF;
+	data[pos++] = snap->flags & 0xF;
+	put_le(data, &pos, snap->call_depth, 4);
+
+	pos = V2_TIMERS_OFFSET;
+	put_le(data, &pos, snap->tick_counter, 4);
+	put_le(data, &pos, snap->clk_timer_timestamp, 4);
+	put_le(data, &pos, snap->prog_timer_timestamp, 4);
+	data[pos++] = snap->prog_timer_enabled & 0x1;
+	data[pos++] = snap->prog_timer_data & 0xFF;
+	data[pos++] = snap->prog_timer_rld & 0xFF;
+
+	pos = V2_INTS_OFFSET;
+	for (i = 0; i < INT_SLOT_NUM; i++) {
+		data[pos++] = snap->interrupts[i].factor_flag_reg & 0xF;
+		data[pos++] = snap->interrupts[i].mask_reg & 0xF;
+		data[pos++] = snap->interrupts[i].triggered & 0x1;
 	}
 }
 
-static void write_rle_flush(struct bit_state *s) {
-	write_small_number(s, s->digit_count-1);
-	flush_bits(s);
+/* Appends an entry to the section table, data[5] being the number of entries */
+static void add_section(uint8_t *data, section_t section, uint32_t offset, uint32_t size)
+{
+	uint32_t pos = V2_HEADER_SIZE + data[5] * V2_SECTION_ENTRY_SIZE;
+
+	memcpy(data + pos, sections[section].tag, 4);
+	pos += 4;
+	put_le(data, &pos, offset, 4);
+	put_le(data, &pos, size, 4);
+	put_le(data, &pos, crc32_update(0, data + offset, size), 4);
+	data[5]++;
 }
 
-void state_save(char *path, bool_t small)
+/* Returns the number of bytes serialized into data (STATE_V2_SIZE) */
+static uint32_t serialize_v2(state_snapshot_t *snap, uint8_t *data)
 {
-	SDL_RWops *f;
-	state_t *state;
-	uint8_t buf[4];
-	uint32_t num = 0;
+	lcd_frame_t frame;
+	uint32_t pos;
 	uint32_t i;
 
-	state = tamalib_get_state();
+	memset(data, 0, STATE_V2_SIZE);
 
-	f = SDL_RWFromFile(path, "w");
-	if (f == NULL) {
-		fprintf(stderr, "FATAL: Cannot create state file \"%s\" !\n", path);
-		return;
+	serialize_v2_core(snap, data);
+
+	/* Memory, one nibble per byte */
+	memcpy(data + V2_MEMORY_OFFSET, snap->memory, V2_MEMORY_SIZE);
+
+	/* LCD, one u32 little-endian per row, then the icons */
+	lcd_decode_frame(snap->memory, &frame);
+	pos = V2_LCD_OFFSET;
+	for (i = 0; i < LCD_HEIGHT; i++) {
+		put_le(data, &pos, frame.rows[i], 4);
 	}
+	data[pos++] = frame.icons;
 
-	struct bit_state bs = { f, 0, 0 };
-	if (small) {
-		write_bits(&bs, *(state->pc), 13);
-		write_bits(&bs, 1, 1); // This marks it as a "small" format file
-		write_rle_start(&bs, *(state->x), 12);
-		write_rle(&bs, *(state->y), 12);
-		write_rle(&bs, *(state->a), 4);
-		write_rle(&bs, *(state->b), 4);
-		write_rle(&bs, *(state->np), 5);
-		write_rle(&bs, *(state->sp), 8);
-		write_rle(&bs, *(state->flags), 4);
-		uint32_t tick_base = *(state->tick_counter);
-		write_rle(&bs, tick_base - *(state->clk_timer_timestamp), 32);
-		write_rle(&bs, tick_base - *(state->prog_timer_timestamp), 32);
-		write_rle(&bs, *(state->prog_timer_enabled), 1);
-		write_rle(&bs, *(state->prog_timer_data), 8);
-		write_rle(&bs, *(state->prog_timer_rld), 8);
-		write_rle(&bs, *(state->call_depth), 32);
-		for (i = 0; i < INT_SLOT_NUM; i++) {
-			write_rle(&bs, state->interrupts[i].factor_flag_reg, 4);
-			write_rle(&bs, state->interrupts[i].mask_reg, 4);
-			write_rle(&bs, state->interrupts[i].triggered, 1);
-		}
-		// Write out RAM; RLE-encode
-		for (i = 0; i < MEMORY_SIZE; i++) {
-			write_rle(&bs, state->memory[i], 4);
-		}
-		write_rle_flush(&bs);
-		SDL_RWclose(f);
-		return;
+	for (i = SECTION_REGS; i <= SECTION_LCD; i++) {
+		add_section(data, i, sections[i].offset, sections[i].size);
+	}
+
+	return STATE_V2_SIZE;
+}
+
+/* Identifies a state by its content, whatever the file it comes from (CRC32
+ * of its full v2 serialization)
+ */
+static uint32_t state_hash(state_snapshot_t *snap)
+{
+	uint8_t data[STATE_V2_SIZE];
+
+	return crc32_update(0, data, serialize_v2(snap, data));
+}
+
+/* Returns the number of bytes serialized into data, or 0 if the delta would
+ * not be smaller than a full state
+ */
+static uint32_t serialize_delta(state_snapshot_t *snap, state_snapshot_t *base, char *base_path, uint8_t *data)
+{
+	uint32_t base_size = 4 + strlen(base_path) + 1;
+	uint32_t delta_offset, pos;
+	uint32_t i = 0, start, end, len;
+
+	if (base_size > V2_BASE_MAX_SIZE) {
+		return 0;
 	}
 
-	/* First the magic, then the version, and finally the fields of
-	 * the state_t struct written as u8, u16 little-endian or u32
-	 * little-endian following the struct order
+	memset(data, 0, V2_BASE_OFFSET);
+
+	serialize_v2_core(snap, data);
+
+	/* Base, as a hash and a path */
+	pos = V2_BASE_OFFSET;
+	put_le(data, &pos, state_hash(base), 4);
+	memcpy(data + pos, base_path, base_size - 4);
+	pos += base_size - 4;
+
+	/* Memory runs that differ from the base, as a u16 start, a u16 length
+	 * and the nibbles. Short gaps are merged, a run header costing more.
 	 */
-	buf[0] = (uint8_t) STATE_FILE_MAGIC[0];
-	buf[1] = (uint8_t) STATE_FILE_MAGIC[1];
-	buf[2] = (uint8_t) STATE_FILE_MAGIC[2];
-	buf[3] = (uint8_t) STATE_FILE_MAGIC[3];
-	num += SDL_RWwrite(f, buf, 4, 1);
+	delta_offset = pos;
+	while (i < MEMORY_SIZE) {
+		if (snap->memory[i] == base->memory[i]) {
+			i++;
+			continue;
+		}
+
+		start = end = i;
+		for (i = start + 1; i < MEMORY_SIZE && i - end <= V2_RUN_HEADER_SIZE; i++) {
+			if (snap->memory[i] != base->memory[i]) {
+				end = i;
+			}
+		}
+
+		len = end - start + 1;
+		if (pos + V2_RUN_HEADER_SIZE + len > STATE_V2_SIZE) {
+			return 0;
+		}
 
-	buf[0] = STATE_FILE_VERSION & 0xFF;
-	num += SDL_RWwrite(f, buf, 1, 1);
+		put_le(data, &pos, start, 2);
+		put_le(data, &pos, len, 2);
+		memcpy(data + pos, snap->memory + start, len);
+		pos += len;
 
-	/* All fields are written as u8, u16 little-endian or u32 little-endian following the struct order */
-	buf[0] = *(state->pc) & 0xFF;
-	buf[1] = (*(state->pc) >> 8) & 0x1F;
-	num += SDL_RWwrite(f, buf, 2, 1);
+		i = end + 1;
+	}
 
-	buf[0] = *(state->x) & 0xFF;
-	buf[1] = (*(state->x) >> 8) & 0xF;
-	num += SDL_RWwrite(f, buf, 2, 1);
+	for (i = SECTION_REGS; i <= SECTION_INTERRUPTS; i++) {
+		add_section(data, i, sections[i].offset, sections[i].size);
+	}
+	add_section(data, SECTION_BASE, V2_BASE_OFFSET, base_size);
+	add_section(data, SECTION_MEMORY_DELTA, delta_offset, pos - delta_offset);
 
-	buf[0] = *(state->y) & 0xFF;
-	buf[1] = (*(state->y) >> 8) & 0xF;
-	num += SDL_RWwrite(f, buf, 2, 1);
+	return pos;
+}
 
-	buf[0] = *(state->a) & 0xF;
-	num += SDL_RWwrite(f, buf, 1, 1);
+static bool_t read_state_file(char *path, state_snapshot_t *snap, state_file_info_t *info, uint32_t level);
 
-	buf[0] = *(state->b) & 0xF;
-	num += SDL_RWwrite(f, buf, 1, 1);
+/* Puts the state in the store, and writes a reference to it at path */
+static bool_t write_store_ref(char *path, state_snapshot_t *snap)
+{
+	uint8_t data[V2_STORE_REF_OFFSET + 8 + sizeof(store_path)];
+	uint8_t object[STORE_OBJECT_SIZE];
+	uint8_t block[STORE_BLOCK_SIZE / 2];
+	char stored_path[sizeof(store_path)];
+	u4_t *nibbles;
+	uint64_t key;
+	uint32_t pos = STORE_CORE_SIZE;
+	uint32_t i, j;
+
+	if (relative_path(path, store_path, stored_path, sizeof(stored_path))) {
+		fprintf(stderr, "FATAL: Cannot reference store \"%s\" from state file \"%s\" !\n", store_path, path);
+		return 1;
+	}
 
-	buf[0] = *(state->np) & 0x1F;
-	num += SDL_RWwrite(f, buf, 1, 1);
+	/* The gaps between sections are part of the object, hence zeroed */
+	memset(data, 0, V2_MEMORY_OFFSET);
+	serialize_v2_core(snap, data);
+	memcpy(object, data + V2_REGS_OFFSET, STORE_CORE_SIZE);
 
-	buf[0] = *(state->sp) & 0xFF;
-	num += SDL_RWwrite(f, buf, 1, 1);
+	for (i = 0; i < STORE_BLOCKS; i++) {
+		nibbles = snap->memory + i * STORE_BLOCK_SIZE;
+		for (j = 0; j < sizeof(block); j++) {
+			block[j] = (nibbles[2 * j] & 0xF) | ((nibbles[2 * j + 1] & 0xF) << 4);
+		}
 
-	buf[0] = *(state->flags) & 0xF;
-	num += SDL_RWwrite(f, buf, 1, 1);
+		if (store_put(block, sizeof(block), &key)) {
+			return 1;
+		}
 
-	buf[0] = *(state->tick_counter) & 0xFF;
-	buf[1] = (*(state->tick_counter) >> 8) & 0xFF;
-	buf[2] = (*(state->tick_counter) >> 16) & 0xFF;
-	buf[3] = (*(state->tick_counter) >> 24) & 0xFF;
-	num += SDL_RWwrite(f, buf, 4, 1);
+		put_le(object, &pos, key & 0xFFFFFFFF, 4);
+		put_le(object, &pos, key >> 32, 4);
+	}
 
-	buf[0] = *(state->clk_timer_timestamp) & 0xFF;
-	buf[1] = (*(state->clk_timer_timestamp) >> 8) & 0xFF;
-	buf[2] = (*(state->clk_timer_timestamp) >> 16) & 0xFF;
-	buf[3] = (*(state->clk_timer_timestamp) >> 24) & 0xFF;
-	num += SDL_RWwrite(f, buf, 4, 1);
+	if (store_put(object, sizeof(object), &key)) {
+		return 1;
+	}
 
-	buf[0] = *(state->prog_timer_timestamp) & 0xFF;
-	buf[1] = (*(state->prog_timer_timestamp) >> 8) & 0xFF;
-	buf[2] = (*(state->prog_timer_timestamp) >> 16) & 0xFF;
-	buf[3] = (*(state->prog_timer_timestamp) >> 24) & 0xFF;
-	num += SDL_RWwrite(f, buf, 4, 1);
+	/* Only the header, the section table and the reference remain */
+	memset(data + 6, 0, V2_STORE_REF_OFFSET - 6);
+	pos = V2_STORE_REF_OFFSET;
+	put_le(data, &pos, key & 0xFFFFFFFF, 4);
+	put_le(data, &pos, key >> 32, 4);
+	memcpy(data + pos, stored_path, strlen(stored_path) + 1);
+	pos += strlen(stored_path) + 1;
+	add_section(data, SECTION_STORE_REF, V2_STORE_REF_OFFSET, pos - V2_STORE_REF_OFFSET);
 
-	buf[0] = *(state->prog_timer_enabled) & 0x1;
-	num += SDL_RWwrite(f, buf, 1, 1);
+	return write_file_atomic(path, data, pos);
+}
 
-	buf[0] = *(state->prog_timer_data) & 0xFF;
-	num += SDL_RWwrite(f, buf, 1, 1);
+/* Writes a full or small state file, leaving the manifest untouched.
+ * Encoding and writing only rely on the snapshot, so this can run on
+ * other threads than the emulation, and on several of them at once.
+ */
+bool_t state_write(char *path, state_snapshot_t *snap, bool_t small)
+{
+	uint8_t data[STATE_BUFFER_SIZE];
+	uint32_t size;
 
-	buf[0] = *(state->prog_timer_rld) & 0xFF;
-	num += SDL_RWwrite(f, buf, 1, 1);
+	if (small) {
+		size = serialize_small(snap, data, STATE_BUFFER_SIZE);
+		if (size > STATE_BUFFER_SIZE) {
+			fprintf(stderr, "FATAL: State too large to be saved to \"%s\" !\n", path);
+			return 1;
+		}
+	} else if (store_path[0]) {
+		return write_store_ref(path, snap);
+	} else {
+		size = serialize_v2(snap, data);
+	}
 
-	buf[0] = *(state->call_depth) & 0xFF;
-	buf[1] = (*(state->call_depth) >> 8) & 0xFF;
-	buf[2] = (*(state->call_depth) >> 16) & 0xFF;
-	buf[3] = (*(state->call_depth) >> 24) & 0xFF;
-	num += SDL_RWwrite(f, buf, 4, 1);
+	return write_file_atomic(path, data, size);
+}
 
-	for (i = 0; i < INT_SLOT_NUM; i++) {
-		buf[0] = state->interrupts[i].factor_flag_reg & 0xF;
-		num += SDL_RWwrite(f, buf, 1, 1);
+/* Saves a full state (or a reference to it in the store) */
+static void save_full(char *path, state_snapshot_t *snap, uint64_t ticks)
+{
+	if (state_write(path, snap, 0)) {
+		return;
+	}
 
-		buf[0] = state->interrupts[i].mask_reg & 0xF;
-		num += SDL_RWwrite(f, buf, 1, 1);
+	/* Saves to a slot are recorded in the manifest */
+	manifest_record(path, store_path[0] ? 'R' : 'L', ticks);
+}
 
-		buf[0] = state->interrupts[i].triggered & 0x1;
-		num += SDL_RWwrite(f, buf, 1, 1);
+/* Saves only what changed since the given base state, which is read back
+ * (along with its own chain) to compute the difference. A full state is
+ * saved instead when there is no usable base, when the chain gets too long,
+ * or when the delta would not be smaller. With a store, identical memory
+ * blocks are already shared, so states are always saved to it instead.
+ */
+void state_save_delta(char *path, char *base_path, state_snapshot_t *snap, uint64_t ticks)
+{
+	state_snapshot_t base;
+	state_file_info_t info;
+	char stored_path[256];
+	uint32_t size = 0;
+	bool_t is_delta;
+
+	if (store_path[0]) {
+		save_full(path, snap, ticks);
+		return;
 	}
 
-	for (i = 0; i < MEMORY_SIZE; i++) {
-		buf[0] = state->memory[i] & 0xF;
-		num += SDL_RWwrite(f, buf, 1, 1);
+	if (base_path[0] && !relative_path(path, base_path, stored_path, sizeof(stored_path))) {
+		memcpy(&base, snap, sizeof(state_snapshot_t));
+		if (!read_state_file(base_path, &base, &info, 0) && info.format != 'S' && info.depth + 1 < STATE_DELTA_MAX_CHAIN) {
+			size = serialize_delta(snap, &base, stored_path, state_buffer);
+		}
 	}
 
-	if (num != (17 + INT_SLOT_NUM * 3 + MEMORY_SIZE)) {
-		fprintf(stderr, "FATAL: Failed to write to state file \"%s\" %u %u !\n", path, num, (23 + INT_SLOT_NUM * 3 + MEMORY_SIZE));
+	is_delta = (size > 0);
+	if (!is_delta) {
+		size = serialize_v2(snap, state_buffer);
 	}
 
-	SDL_RWclose(f);
+	if (write_file_atomic(path, state_buffer, size)) {
+		return;
+	}
+
+	manifest_record(path, is_delta ? 'D' : 'L', ticks);
+}
+
+/* Saves to the next slot, as a full state unless deltas are enabled (only
+ * what changed since the last slot is then saved)
+ */
+void state_save_next(state_snapshot_t *snap, uint64_t ticks)
+{
+	char path[256];
+	char base_path[256];
+
+	state_find_next_name(path);
+
+	if (!delta_enabled) {
+		save_full(path, snap, ticks);
+		return;
+	}
+
+	state_find_last_name(base_path);
+	state_save_delta(path, base_path, snap, ticks);
 }
 
 void state_debug(void) {
@@ -368,141 +1222,573 @@ void state_debug(void) {
 	}
 }
 
-void state_load(char *path)
+static void parse_small(uint8_t *data, uint32_t size, state_snapshot_t *snap)
 {
-	SDL_RWops *f;
-	state_t *state;
-	uint8_t buf[4];
-	uint32_t num = 0;
+	struct bit_state bs = { data, size, 0, 0, 0 };
+	uint32_t tick_base;
+	uint64_t word;
+	uint32_t i, j;
+
+	snap->pc = read_bits(&bs, 13);
+	read_bits(&bs, 1); // "small" format marker
+	snap->x = read_rle_start(&bs, 12);
+	snap->y = read_rle(&bs, 12);
+	snap->a = read_rle(&bs, 4);
+	snap->b = read_rle(&bs, 4);
+	snap->np = read_rle(&bs, 5);
+	snap->sp = read_rle(&bs, 8);
+	snap->flags = read_rle(&bs, 4);
+	tick_base = snap->tick_counter;
+	snap->clk_timer_timestamp = tick_base - read_rle(&bs, 32);
+	snap->prog_timer_timestamp = tick_base - read_rle(&bs, 32);
+	snap->prog_timer_enabled = read_rle(&bs, 1);
+	snap->prog_timer_data = read_rle(&bs, 8);
+	snap->prog_timer_rld = read_rle(&bs, 8);
+	snap->call_depth = read_rle(&bs, 32);
+	for (i = 0; i < INT_SLOT_NUM; i++) {
+		snap->interrupts[i].factor_flag_reg = read_rle(&bs, 4);
+		snap->interrupts[i].mask_reg = read_rle(&bs, 4);
+		snap->interrupts[i].triggered = read_rle(&bs, 1);
+	}
+	// Read RAM, RLE-encoded, 16 nibbles at a time
+	for (i = 0; i < MEMORY_SIZE; i += 16) {
+		word = read_rle(&bs, 64);
+		for (j = 0; j < 16; j++) {
+			snap->memory[i + j] = (word >> (4 * j)) & 0xF;
+		}
+	}
+}
+
+static bool_t parse_v1(uint8_t *data, uint32_t size, char *path, state_snapshot_t *snap)
+{
+	uint32_t pos = 5;
 	uint32_t i;
 
-	state = tamalib_get_state();
+	/* After the magic and the version, the fields of the state_t struct
+	 * are read as u8, u16 little-endian or u32 little-endian following
+	 * the struct order
+	 */
+	if (size < STATE_V1_SIZE) {
+		fprintf(stderr, "FATAL: Failed to read from state file \"%s\" !\n", path);
+		return 1;
+	}
 
-	f = SDL_RWFromFile(path, "r");
-	if (f == NULL) {
-		fprintf(stderr, "FATAL: Cannot open state file \"%s\" !\n", path);
-		return;
+	snap->pc = get_le(data, &pos, 2) & 0x1FFF;
+	snap->x = get_le(data, &pos, 2) & 0xFFF;
+	snap->y = get_le(data, &pos, 2) & 0xFFF;
+	snap->a = data[pos++] & 0xF;
+	snap->b = data[pos++] & 0xF;
+	snap->np = data[pos++] & 0x1F;
+	snap->sp = data[pos++];
+	snap->flags = data[pos++] & 0xF;
+	snap->tick_counter = get_le(data, &pos, 4);
+	snap->clk_timer_timestamp = get_le(data, &pos, 4);
+	snap->prog_timer_timestamp = get_le(data, &pos, 4);
+	snap->prog_timer_enabled = data[pos++] & 0x1;
+	snap->prog_timer_data = data[pos++];
+	snap->prog_timer_rld = data[pos++];
+	snap->call_depth = get_le(data, &pos, 4);
+
+	for (i = 0; i < INT_SLOT_NUM; i++) {
+		snap->interrupts[i].factor_flag_reg = data[pos++] & 0xF;
+		snap->interrupts[i].mask_reg = data[pos++] & 0xF;
+		snap->interrupts[i].triggered = data[pos++] & 0x1;
 	}
 
-	struct bit_state bs = { f, 0, 0 };
-	*(state->pc) = read_bits(&bs, 13);
-	// check whether this is a "small" format file
-	if (read_bits(&bs, 1)) {
-		// this is "small"
-		*(state->x) = read_rle_start(&bs, 12);
-		*(state->y) = read_rle(&bs, 12);
-		*(state->a) = read_rle(&bs, 4);
-		*(state->b) = read_rle(&bs, 4);
-		*(state->np) = read_rle(&bs, 5);
-		*(state->sp) = read_rle(&bs, 8);
-		*(state->flags) = read_rle(&bs, 4);
-		uint32_t tick_base = *(state->tick_counter);
-		*(state->clk_timer_timestamp) = tick_base - read_rle(&bs, 32);
-		*(state->prog_timer_timestamp) = tick_base - read_rle(&bs, 32);
-		*(state->prog_timer_enabled) = read_rle(&bs, 1);
-		*(state->prog_timer_data) = read_rle(&bs, 8);
-		*(state->prog_timer_rld) = read_rle(&bs, 8);
-		*(state->call_depth) = read_rle(&bs, 32);
-		for (i = 0; i < INT_SLOT_NUM; i++) {
-			state->interrupts[i].factor_flag_reg = read_rle(&bs, 4);
-			state->interrupts[i].mask_reg = read_rle(&bs, 4);
-			state->interrupts[i].triggered = read_rle(&bs, 1);
-		}
-		// Read RAM, RLE-encoded
-		for (i = 0; i < MEMORY_SIZE; i++) {
-			state->memory[i] = read_rle(&bs, 4);
+	for (i = 0; i < MEMORY_SIZE; i++) {
+		snap->memory[i] = data[pos++] & 0xF;
+	}
+
+	return 0;
+}
+
+/* Applies the memory runs of a delta state */
+static bool_t apply_memory_delta(uint8_t *data, uint32_t size, char *path, state_snapshot_t *snap)
+{
+	uint32_t pos = 0;
+	uint32_t start, len;
+
+	while (pos < size) {
+		if (size - pos < V2_RUN_HEADER_SIZE) {
+			break;
 		}
-		SDL_RWclose(f);
-		return;
+
+		start = get_le(data, &pos, 2);
+		len = get_le(data, &pos, 2);
+		if (start + len > MEMORY_SIZE || len > size - pos) {
+			break;
+		}
+
+		memcpy(snap->memory + start, data + pos, len);
+		pos += len;
 	}
-	// HACK to use the "long form" save format
-	buf[0] = STATE_FILE_MAGIC[0];
-	buf[1] = STATE_FILE_MAGIC[1];
-	/* First the magic, then the version, and finally the fields of
-	 * the state_t struct written as u8, u16 little-endian or u32
-	 * little-endian following the struct order
-	 */
-	num += SDL_RWread(f, buf+2, 2, 1);
-	if (buf[0] != (uint8_t) STATE_FILE_MAGIC[0] || buf[1] != (uint8_t) STATE_FILE_MAGIC[1] ||
-		buf[2] != (uint8_t) STATE_FILE_MAGIC[2] || buf[3] != (uint8_t) STATE_FILE_MAGIC[3]) {
-		fprintf(stderr, "FATAL: Wrong state file magic in \"%s\" !\n", path);
-		return;
+
+	if (pos != size) {
+		fprintf(stderr, "FATAL: Malformed memory delta in state file \"%s\" !\n", path);
+		return 1;
 	}
 
-	num += SDL_RWread(f, buf, 1, 1);
-	if (buf[0] != STATE_FILE_VERSION) {
-		fprintf(stderr, "FATAL: Unsupported version %u (expected %u) in state file \"%s\" !\n", buf[0], STATE_FILE_VERSION, path);
-		/* TODO: Handle migration at a point */
-		return;
+	return 0;
+}
+
+/* Loads the base of a delta state into snap */
+static bool_t read_base(uint8_t *data, uint32_t size, char *path, state_snapshot_t *snap, state_file_info_t *info, uint32_t level)
+{
+	char base_path[256];
+	uint32_t pos = 0;
+	uint32_t hash;
+
+	hash = (size > 4) ? get_le(data, &pos, 4) : 0;
+	if (size <= 4 || data[size - 1] != '\0' || resolve_path(path, (char *) data + pos, base_path, sizeof(base_path))) {
+		fprintf(stderr, "FATAL: Malformed base reference in state file \"%s\" !\n", path);
+		return 1;
+	}
+
+	if (level >= STATE_DELTA_MAX_DEPTH) {
+		fprintf(stderr, "FATAL: Too many bases behind state file \"%s\" !\n", path);
+		return 1;
+	}
+
+	if (read_state_file(base_path, snap, info, level + 1)) {
+		return 1;
+	}
+
+	if (state_hash(snap) != hash) {
+		fprintf(stderr, "FATAL: Base \"%s\" of state file \"%s\" has changed !\n", base_path, path);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Registers, timers and interrupts sections, common to full and delta states */
+static void parse_v2_core(uint8_t *regs, uint8_t *timers, uint8_t *ints, state_snapshot_t *snap)
+{
+	uint32_t pos;
+	uint32_t i;
+
+	pos = 0;
+	snap->pc = get_le(regs, &pos, 2) & 0x1FFF;
+	snap->x = get_le(regs, &pos, 2) & 0xFFF;
+	snap->y = get_le(regs, &pos, 2) & 0xFFF;
+	snap->a = regs[pos++] & 0xF;
+	snap->b = regs[pos++] & 0xF;
+	snap->np = regs[pos++] & 0x1F;
+	snap->sp = regs[pos++];
+	snap->flags = regs[pos++] & 0xF;
+	snap->call_depth = get_le(regs, &pos, 4);
+
+	pos = 0;
+	snap->tick_counter = get_le(timers, &pos, 4);
+	snap->clk_timer_timestamp = get_le(timers, &pos, 4);
+	snap->prog_timer_timestamp = get_le(timers, &pos, 4);
+	snap->prog_timer_enabled = timers[pos++] & 0x1;
+	snap->prog_timer_data = timers[pos++];
+	snap->prog_timer_rld = timers[pos++];
+
+	pos = 0;
+	for (i = 0; i < INT_SLOT_NUM; i++) {
+		snap->interrupts[i].factor_flag_reg = ints[pos++] & 0xF;
+		snap->interrupts[i].mask_reg = ints[pos++] & 0xF;
+		snap->interrupts[i].triggered = ints[pos++] & 0x1;
+	}
+}
+
+/* Loads a state from the store, given the reference to its object */
+static bool_t read_store_ref(uint8_t *data, uint32_t size, char *path, state_snapshot_t *snap)
+{
+	uint8_t object[STORE_OBJECT_SIZE];
+	uint8_t block[STORE_BLOCK_SIZE / 2];
+	char ref_store_path[sizeof(store_path)];
+	char abs_path[sizeof(store_path)];
+	u4_t *nibbles;
+	uint64_t key;
+	uint32_t pos = 0;
+	uint32_t i, j;
+
+	if (size <= 8 || data[size - 1] != '\0' || resolve_path(path, (char *) data + 8, ref_store_path, sizeof(ref_store_path))) {
+		fprintf(stderr, "FATAL: Malformed store reference in state file \"%s\" !\n", path);
+		return 1;
 	}
 
-	/* All fields are read as u8, u16 little-endian or u32 little-endian following the struct order */
-	num += SDL_RWread(f, buf, 2, 1);
-	*(state->pc) = buf[0] | ((buf[1] & 0x1F) << 8);
+	key = get_le(data, &pos, 4);
+	key |= ((uint64_t) get_le(data, &pos, 4)) << 32;
 
-	num += SDL_RWread(f, buf, 2, 1);
-	*(state->x) = buf[0] | ((buf[1] & 0xF) << 8);
+	if (absolute_path(ref_store_path, abs_path, sizeof(abs_path)) || store_open(abs_path) || store_get(key, object, sizeof(object))) {
+		return 1;
+	}
 
-	num += SDL_RWread(f, buf, 2, 1);
-	*(state->y) = buf[0] | ((buf[1] & 0xF) << 8);
+	pos = STORE_CORE_SIZE;
+	for (i = 0; i < STORE_BLOCKS; i++) {
+		key = get_le(object, &pos, 4);
+		key |= ((uint64_t) get_le(object, &pos, 4)) << 32;
 
-	num += SDL_RWread(f, buf, 1, 1);
-	*(state->a) = buf[0] & 0xF;
+		if (store_get(key, block, sizeof(block))) {
+			return 1;
+		}
 
-	num += SDL_RWread(f, buf, 1, 1);
-	*(state->b) = buf[0] & 0xF;
+		nibbles = snap->memory + i * STORE_BLOCK_SIZE;
+		for (j = 0; j < sizeof(block); j++) {
+			nibbles[2 * j] = block[j] & 0xF;
+			nibbles[2 * j + 1] = block[j] >> 4;
+		}
+	}
 
-	num += SDL_RWread(f, buf, 1, 1);
-	*(state->np) = buf[0] & 0x1F;
+	parse_v2_core(object, object + (V2_TIMERS_OFFSET - V2_REGS_OFFSET), object + (V2_INTS_OFFSET - V2_REGS_OFFSET), snap);
 
-	num += SDL_RWread(f, buf, 1, 1);
-	*(state->sp) = buf[0];
+	return 0;
+}
 
-	num += SDL_RWread(f, buf, 1, 1);
-	*(state->flags) = buf[0] & 0xF;
+/* Every section is checked before anything is applied, unknown sections
+ * are skipped
+ */
+static bool_t parse_v2(uint8_t *data, uint32_t size, char *path, state_snapshot_t *snap, state_file_info_t *info, uint32_t level)
+{
+	uint8_t *found[SECTION_NUM] = {NULL};
+	uint32_t found_size[SECTION_NUM] = {0};
+	uint32_t num, offset, section_size, crc;
+	uint32_t pos;
+	uint32_t i, j;
+
+	num = (size >= V2_HEADER_SIZE) ? data[5] : 0;
+	if (size < V2_HEADER_SIZE + num * V2_SECTION_ENTRY_SIZE) {
+		fprintf(stderr, "FATAL: Truncated state file \"%s\" !\n", path);
+		return 1;
+	}
 
-	num += SDL_RWread(f, buf, 4, 1);
-	*(state->tick_counter) = buf[0] | (buf[1] << 8) | (buf[2] << 16) | (buf[3] << 24);
+	pos = V2_HEADER_SIZE;
+	for (i = 0; i < num; i++) {
+		for (j = 0; j < SECTION_NUM && memcmp(data + pos, sections[j].tag, 4); j++);
+		pos += 4;
+		offset = get_le(data, &pos, 4);
+		section_size = get_le(data, &pos, 4);
+		crc = get_le(data, &pos, 4);
+
+		if (offset > size || section_size > size - offset) {
+			fprintf(stderr, "FATAL: Truncated state file \"%s\" !\n", path);
+			return 1;
+		}
 
-	num += SDL_RWread(f, buf, 4, 1);
-	*(state->clk_timer_timestamp) = buf[0] | (buf[1] << 8) | (buf[2] << 16) | (buf[3] << 24);
+		if (crc32_update(0, data + offset, section_size) != crc) {
+			fprintf(stderr, "FATAL: Corrupted section %u in state file \"%s\" !\n", i, path);
+			return 1;
+		}
 
-	num += SDL_RWread(f, buf, 4, 1);
-	*(state->prog_timer_timestamp) = buf[0] | (buf[1] << 8) | (buf[2] << 16) | (buf[3] << 24);
+		if (j == SECTION_NUM) {
+			continue;
+		}
 
-	num += SDL_RWread(f, buf, 1, 1);
-	*(state->prog_timer_enabled) = buf[0] & 0x1;
+		if (sections[j].size != 0 && section_size != sections[j].size) {
+			fprintf(stderr, "FATAL: Wrong size for section %s in state file \"%s\" !\n", sections[j].tag, path);
+			return 1;
+		}
 
-	num += SDL_RWread(f, buf, 1, 1);
-	*(state->prog_timer_data) = buf[0];
+		found[j] = data + offset;
+		found_size[j] = section_size;
+	}
 
-	num += SDL_RWread(f, buf, 1, 1);
-	*(state->prog_timer_rld) = buf[0];
+	if (found[SECTION_STORE_REF] != NULL) {
+		info->format = 'R';
+		info->depth = 0;
+		return read_store_ref(found[SECTION_STORE_REF], found_size[SECTION_STORE_REF], path, snap);
+	}
 
-	num += SDL_RWread(f, buf, 4, 1);
-	*(state->call_depth) = buf[0] | (buf[1] << 8) | (buf[2] << 16) | (buf[3] << 24);
+	for (j = 0; j < SECTION_NUM; j++) {
+		if (sections[j].required && found[j] == NULL) {
+			fprintf(stderr, "FATAL: Missing section %s in state file \"%s\" !\n", sections[j].tag, path);
+			return 1;
+		}
+	}
 
-	for (i = 0; i < INT_SLOT_NUM; i++) {
-		num += SDL_RWread(f, buf, 1, 1);
-		state->interrupts[i].factor_flag_reg = buf[0] & 0xF;
+	if (found[SECTION_MEMORY] == NULL && (found[SECTION_BASE] == NULL || found[SECTION_MEMORY_DELTA] == NULL)) {
+		fprintf(stderr, "FATAL: Missing memory in state file \"%s\" !\n", path);
+		return 1;
+	}
 
-		num += SDL_RWread(f, buf, 1, 1);
-		state->interrupts[i].mask_reg = buf[0] & 0xF;
+	if (found[SECTION_MEMORY] != NULL) {
+		info->format = 'L';
+		info->depth = 0;
+		memcpy(snap->memory, found[SECTION_MEMORY], V2_MEMORY_SIZE);
+	} else {
+		if (read_base(found[SECTION_BASE], found_size[SECTION_BASE], path, snap, info, level) ||
+			apply_memory_delta(found[SECTION_MEMORY_DELTA], found_size[SECTION_MEMORY_DELTA], path, snap)) {
+			return 1;
+		}
 
-		num += SDL_RWread(f, buf, 1, 1);
-		state->interrupts[i].triggered = buf[0] & 0x1;
+		info->format = 'D';
+		info->depth++;
 	}
 
-	for (i = 0; i < MEMORY_SIZE; i++) {
-		num += SDL_RWread(f, buf, 1, 1);
-		state->memory[i] = buf[0] & 0xF;
+	parse_v2_core(found[SECTION_REGS], found[SECTION_TIMERS], found[SECTION_INTERRUPTS], snap);
+
+	return 0;
+}
+
+/* Gives access to the whole content of a file, mapped if possible */
+static bool_t map_file(char *path, uint8_t **data, uint32_t *size)
+{
+#if defined(__WIN32__)
+	SDL_RWops *f;
+	Sint64 file_size;
+
+	f = SDL_RWFromFile(path, "rb");
+	if (f == NULL) {
+		fprintf(stderr, "FATAL: Cannot open state file \"%s\" !\n", path);
+		return 1;
 	}
 
-	if (num != (17 + INT_SLOT_NUM * 3 + MEMORY_SIZE)) {
+	/* Not the shared buffer, since the bases of a delta are read recursively */
+	file_size = SDL_RWsize(f);
+	*data = (file_size > 0 && file_size <= STATE_BUFFER_SIZE) ? SDL_malloc(file_size) : NULL;
+	if (*data == NULL || SDL_RWread(f, *data, file_size, 1) != 1) {
 		fprintf(stderr, "FATAL: Failed to read from state file \"%s\" !\n", path);
+		SDL_free(*data);
+		SDL_RWclose(f);
+		return 1;
 	}
 
 	SDL_RWclose(f);
 
+	*size = (uint32_t) file_size;
+#else
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "FATAL: Cannot open state file \"%s\" !\n", path);
+		return 1;
+	}
+
+	if (fstat(fd, &st) < 0 || st.st_size <= 0 || st.st_size > UINT32_MAX) {
+		fprintf(stderr, "FATAL: Failed to read from state file \"%s\" !\n", path);
+		close(fd);
+		return 1;
+	}
+
+	*size = (uint32_t) st.st_size;
+	*data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (*data == MAP_FAILED) {
+		fprintf(stderr, "FATAL: Failed to map state file \"%s\" !\n", path);
+		return 1;
+	}
+#endif
+
+	return 0;
+}
+
+static void unmap_file(uint8_t *data, uint32_t size)
+{
+#if defined(__WIN32__)
+	SDL_free(data);
+#else
+	munmap(data, size);
+#endif
+}
+
+/* Parses the content of a state file in any format, path being only used
+ * in messages
+ */
+static bool_t parse_state(uint8_t *data, uint32_t size, char *path, state_snapshot_t *snap, state_file_info_t *info, uint32_t level)
+{
+	struct bit_state bs;
+	bool_t failed = 0;
+
+	/* The 14th bit tells whether this is a "small" format file (it is
+	 * always 0 in the magic of the other formats)
+	 */
+	bs = (struct bit_state) { data, size, 0, 0, 0 };
+	read_bits(&bs, 13);
+	if (read_bits(&bs, 1)) {
+		parse_small(data, size, snap);
+		info->format = 'S';
+		info->depth = 0;
+	} else if (size < 5 || memcmp(data, STATE_FILE_MAGIC, 4)) {
+		fprintf(stderr, "FATAL: Wrong state file magic in \"%s\" !\n", path);
+		failed = 1;
+	} else if (data[4] == 1) {
+		failed = parse_v1(data, size, path, snap);
+		info->format = 'L';
+		info->depth = 0;
+	} else if (data[4] == STATE_FILE_VERSION) {
+		failed = parse_v2(data, size, path, snap, info, level);
+	} else {
+		fprintf(stderr, "FATAL: Unsupported version %u (expected %u) in state file \"%s\" !\n", data[4], STATE_FILE_VERSION, path);
+		failed = 1;
+	}
+
+	return failed;
+}
+
+/* Reads any state file into snap, following the bases of a delta. The
+ * small format is relative to the tick counter already in snap.
+ */
+static bool_t read_state_file(char *path, state_snapshot_t *snap, state_file_info_t *info, uint32_t level)
+{
+	uint8_t *data;
+	uint32_t size;
+	bool_t failed;
+
+	if (map_file(path, &data, &size)) {
+		return 1;
+	}
+
+	failed = parse_state(data, size, path, snap, info, level);
+
+	unmap_file(data, size);
+
+	return failed;
+}
+
+/* The v1 and small formats are still loaded, and are migrated to v2 by
+ * the next save
+ */
+void state_load(char *path)
+{
+	state_snapshot_t snap;
+	state_file_info_t info;
+
+	state_capture(&snap);
+
+	if (read_state_file(path, &snap, &info, 0)) {
+		return;
+	}
+
+	state_restore(&snap);
+}
+
+/* Reads any state file without touching the emulation, the small format
+ * being relative to the tick counter in snap. Can be called from several
+ * threads at once.
+ */
+bool_t state_read(char *path, state_snapshot_t *snap)
+{
+	state_file_info_t info;
+
+	return read_state_file(path, snap, &info, 0);
+}
+
+/* Folds a delta chain (or an older format) into a full v2 state, in place.
+ * The content, hence the hash deltas refer to, does not change.
+ */
+bool_t state_compact(char *path)
+{
+	state_snapshot_t snap;
+	state_file_info_t info;
+
+	memset(&snap, 0, sizeof(state_snapshot_t));
+
+	if (read_state_file(path, &snap, &info, 0)) {
+		return 1;
+	}
+
+	if (write_file_atomic(path, state_buffer, serialize_v2(&snap, state_buffer))) {
+		return 1;
+	}
+
+	manifest_set_format(path, 'L');
+
+	return 0;
+}
+
+/* Serializes a full state into data, for it to be stored elsewhere than
+ * in a file. Returns the number of bytes used, or 0 if size is too small.
+ */
+uint32_t state_encode(state_snapshot_t *snap, uint8_t *data, uint32_t size)
+{
+	if (size < STATE_V2_SIZE) {
+		return 0;
+	}
+
+	return serialize_v2(snap, data);
+}
+
+/* Parses a state encoded by state_encode() (or the content of any state
+ * file), name being only used in messages
+ */
+bool_t state_decode(uint8_t *data, uint32_t size, char *name, state_snapshot_t *snap)
+{
+	state_file_info_t info;
+
+	return parse_state(data, size, name, snap, &info, 0);
+}
+
+/* Saves to the next slot are then deltas against the last one. Each one
+ * needs all the previous ones of its chain to be loaded.
+ */
+void state_set_delta(bool_t enable)
+{
+	delta_enabled = enable;
+}
+
+/* Full states are then saved to the given store (created if needed),
+ * files only referencing them
+ */
+bool_t state_set_store(char *path)
+{
+	char abs_path[sizeof(store_path)];
+
+	strncpy(store_path, path, sizeof(store_path) - 1);
+	normalize_path(store_path);
+
+	/* The store is opened by its absolute path, as when loading references
+	 * to it from other directories
+	 */
+	if (absolute_path(store_path, abs_path, sizeof(abs_path)) || store_open(abs_path)) {
+		store_path[0] = '\0';
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Copy the whole emulation state, to be restored later on */
+void state_capture(state_snapshot_t *snap)
+{
+	state_t *state = tamalib_get_state();
+
+	snap->pc = *(state->pc);
+	snap->x = *(state->x);
+	snap->y = *(state->y);
+	snap->a = *(state->a);
+	snap->b = *(state->b);
+	snap->np = *(state->np);
+	snap->sp = *(state->sp);
+	snap->flags = *(state->flags);
+	snap->tick_counter = *(state->tick_counter);
+	snap->clk_timer_timestamp = *(state->clk_timer_timestamp);
+	snap->prog_timer_timestamp = *(state->prog_timer_timestamp);
+	snap->prog_timer_enabled = *(state->prog_timer_enabled);
+	snap->prog_timer_data = *(state->prog_timer_data);
+	snap->prog_timer_rld = *(state->prog_timer_rld);
+	snap->call_depth = *(state->call_depth);
+	memcpy(snap->interrupts, state->interrupts, sizeof(snap->interrupts));
+	memcpy(snap->memory, state->memory, sizeof(snap->memory));
+}
+
+void state_restore(state_snapshot_t *snap)
+{
+	state_t *state = tamalib_get_state();
+
+	*(state->pc) = snap->pc;
+	*(state->x) = snap->x;
+	*(state->y) = snap->y;
+	*(state->a) = snap->a;
+	*(state->b) = snap->b;
+	*(state->np) = snap->np;
+	*(state->sp) = snap->sp;
+	*(state->flags) = snap->flags;
+	*(state->tick_counter) = snap->tick_counter;
+	*(state->clk_timer_timestamp) = snap->clk_timer_timestamp;
+	*(state->prog_timer_timestamp) = snap->prog_timer_timestamp;
+	*(state->prog_timer_enabled) = snap->prog_timer_enabled;
+	*(state->prog_timer_data) = snap->prog_timer_data;
+	*(state->prog_timer_rld) = snap->prog_timer_rld;
+	*(state->call_depth) = snap->call_depth;
+	memcpy(state->interrupts, snap->interrupts, sizeof(snap->interrupts));
+	memcpy(state->memory, snap->memory, sizeof(snap->memory));
+
 	tamalib_refresh_hw();
 }
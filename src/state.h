@@ -20,13 +20,54 @@
 #ifndef _STATE_H_
 #define _STATE_H_
 
+#include "lib/tamalib.h"
+
 #define STATE_TEMPLATE			"save%u.bin"
+#define STATE_MANIFEST			"saves.idx" // Slot, timestamp, emulated time (ticks) and format of each save
+#define STATE_TMP_SUFFIX		".tmp" // Appended to files being written
+
+#define EMU_TICK_FREQUENCY		32768 // Hz, rate of the tick_counter (emulated time)
+
+/* Plain copy of the content pointed by state_t */
+typedef struct {
+	u13_t pc;
+	u12_t x;
+	u12_t y;
+	u4_t a;
+	u4_t b;
+	u5_t np;
+	u8_t sp;
+	u4_t flags;
+
+	u32_t tick_counter;
+	u32_t clk_timer_timestamp;
+	u32_t prog_timer_timestamp;
+	bool_t prog_timer_enabled;
+	u8_t prog_timer_data;
+	u8_t prog_timer_rld;
+
+	u32_t call_depth;
+
+	interrupt_t interrupts[INT_SLOT_NUM];
+
+	u4_t memory[MEMORY_SIZE];
+} state_snapshot_t;
 
 
+void state_set_delta(bool_t enable);
+bool_t state_set_store(char *path);
 void state_find_next_name(char *path);
 void state_find_last_name(char *path);
-void state_save(char *path, bool_t small);
+bool_t state_write(char *path, state_snapshot_t *snap, bool_t small);
+void state_save_delta(char *path, char *base_path, state_snapshot_t *snap, uint64_t ticks);
+void state_save_next(state_snapshot_t *snap, uint64_t ticks);
 void state_load(char *path);
+bool_t state_read(char *path, state_snapshot_t *snap);
+bool_t state_compact(char *path);
+uint32_t state_encode(state_snapshot_t *snap, uint8_t *data, uint32_t size);
+bool_t state_decode(uint8_t *data, uint32_t size, char *name, state_snapshot_t *snap);
 void state_debug(void);
+void state_capture(state_snapshot_t *snap);
+void state_restore(state_snapshot_t *snap);
 
 #endif /* _STATE_H_ */
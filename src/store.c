@@ -0,0 +1,504 @@
+/*
+ * TamaTool - A cross-platform Tamagotchi P1 explorer
+ *
+ * Copyright (C) 2021 Jean-Christophe Rona <jc@rona.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#if defined(__WIN32__)
+#include <windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#endif
+
+#include "SDL.h"
+
+#include "store.h"
+#include "crc32.h"
+
+#define STORE_MAGIC			"TLSP"
+#define STORE_VERSION			1
+#define STORE_HEADER_SIZE		8
+#define STORE_RECORD_HEADER_SIZE	16 // Key, size and CRC32 of the data
+#define STORE_MAX_RECORD_SIZE		(64 * 1024)
+#define STORE_INDEX_MIN_SIZE		1024 // Entries, power of 2
+#define STORE_COMPARE_SIZE		1024
+
+#define FNV_OFFSET_BASIS		0xCBF29CE484222325ULL
+#define FNV_PRIME			0x100000001B3ULL
+
+#if defined(__WIN32__)
+#define file_seek(fp, offset)		_fseeki64(fp, offset, SEEK_SET)
+#define file_tell(fp)			((uint64_t) _ftelli64(fp))
+#else
+#define file_seek(fp, offset)		fseeko(fp, offset, SEEK_SET)
+#define file_tell(fp)			((uint64_t) ftello(fp))
+#endif
+
+/* The store is a single append-only file of records, each one being some
+ * data keyed by the hash of its content, so that identical data is only
+ * stored once. Only the index (key to record position) is kept in memory.
+ * Several processes can share the store, appends being serialized by a
+ * lock on the file. The data behind a known key is compared before being
+ * reused, a key being only a hash.
+ */
+typedef struct {
+	uint64_t key;
+	uint64_t offset; // Of the data in the file, 0 for an empty entry
+	uint32_t size;
+} entry_t;
+
+static FILE *store_fp = NULL;
+static char store_path[256];
+static uint64_t store_end = 0; // End of the last complete record
+
+static entry_t *entries = NULL;
+static uint32_t entry_num = 0;
+static uint32_t entry_max = 0;
+
+static SDL_mutex *store_mutex = NULL;
+static SDL_SpinLock open_lock = 0;
+
+
+static void put_le(uint8_t *data, uint32_t *pos, uint64_t val, uint8_t bytes)
+{
+	while (bytes--) {
+		data[(*pos)++] = val & 0xFF;
+		val >>= 8;
+	}
+}
+
+static uint64_t get_le(uint8_t *data, uint32_t *pos, uint8_t bytes)
+{
+	uint64_t val = 0;
+	uint8_t i;
+
+	for (i = 0; i < bytes; i++) {
+		val |= ((uint64_t) data[(*pos)++]) << (i * 8);
+	}
+
+	return val;
+}
+
+/* FNV-1a, seeded with the size */
+static uint64_t hash_data(uint8_t *data, uint32_t size)
+{
+	uint64_t hash = FNV_OFFSET_BASIS ^ size;
+	uint32_t i;
+
+	for (i = 0; i < size; i++) {
+		hash = (hash ^ data[i]) * FNV_PRIME;
+	}
+
+	return hash;
+}
+
+static entry_t * find_entry(uint64_t key)
+{
+	uint32_t i = key & (entry_max - 1);
+
+	while (entries[i].offset != 0 && entries[i].key != key) {
+		i = (i + 1) & (entry_max - 1);
+	}
+
+	return &entries[i];
+}
+
+static bool_t add_entry(uint64_t key, uint64_t offset, uint32_t size)
+{
+	entry_t *old_entries = entries;
+	uint32_t old_max = entry_max;
+	entry_t *entry;
+	uint32_t i;
+
+	/* Kept at most half full */
+	if ((entry_num + 1) * 2 > entry_max) {
+		entries = SDL_calloc(old_max * 2, sizeof(entry_t));
+		if (entries == NULL) {
+			entries = old_entries;
+			fprintf(stderr, "FATAL: Cannot allocate the store index !\n");
+			return 1;
+		}
+
+		entry_max = old_max * 2;
+
+		for (i = 0; i < old_max; i++) {
+			if (old_entries[i].offset != 0) {
+				*find_entry(old_entries[i].key) = old_entries[i];
+			}
+		}
+
+		SDL_free(old_entries);
+	}
+
+	entry = find_entry(key);
+	if (entry->offset == 0) {
+		*entry = (entry_t) {key, offset, size};
+		entry_num++;
+	}
+
+	return 0;
+}
+
+/* Waits for the data written to fp to reach the disk */
+static bool_t sync_file(FILE *fp)
+{
+	if (fflush(fp) != 0) {
+		return 1;
+	}
+
+#if defined(__WIN32__)
+	return !FlushFileBuffers((HANDLE) _get_osfhandle(_fileno(fp)));
+#else
+	return fsync(fileno(fp)) != 0;
+#endif
+}
+
+/* Serializes the appends of every process using the store. On Windows,
+ * the lock is taken on a byte far past the end, as a locked range cannot
+ * be read by the other processes.
+ */
+static bool_t lock_file(void)
+{
+#if defined(__WIN32__)
+	OVERLAPPED overlapped = {0};
+
+	overlapped.OffsetHigh = 0x7FFFFFFF;
+	if (!LockFileEx((HANDLE) _get_osfhandle(_fileno(store_fp)), LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &overlapped)) {
+#else
+	struct flock lock = {0};
+	int ret;
+
+	lock.l_type = F_WRLCK;
+	lock.l_whence = SEEK_SET;
+	while ((ret = fcntl(fileno(store_fp), F_SETLKW, &lock)) != 0 && errno == EINTR);
+	if (ret != 0) {
+#endif
+		fprintf(stderr, "FATAL: Cannot lock store file \"%s\" !\n", store_path);
+		return 1;
+	}
+
+	return 0;
+}
+
+static void unlock_file(void)
+{
+#if defined(__WIN32__)
+	OVERLAPPED overlapped = {0};
+
+	overlapped.OffsetHigh = 0x7FFFFFFF;
+	UnlockFileEx((HANDLE) _get_osfhandle(_fileno(store_fp)), 0, 1, 0, &overlapped);
+#else
+	struct flock lock = {0};
+
+	lock.l_type = F_UNLCK;
+	lock.l_whence = SEEK_SET;
+	fcntl(fileno(store_fp), F_SETLK, &lock);
+#endif
+}
+
+/* Checks the header of the store, writing it if the store is new */
+static bool_t check_header(void)
+{
+	uint8_t header[STORE_HEADER_SIZE] = {0};
+
+	if (fseek(store_fp, 0, SEEK_END) != 0) {
+		fprintf(stderr, "FATAL: Failed to read from store file \"%s\" !\n", store_path);
+		return 1;
+	}
+
+	if (file_tell(store_fp) == 0) {
+		memcpy(header, STORE_MAGIC, 4);
+		header[4] = STORE_VERSION;
+		if (fwrite(header, STORE_HEADER_SIZE, 1, store_fp) != 1 || sync_file(store_fp)) {
+			fprintf(stderr, "FATAL: Failed to write to store file \"%s\" !\n", store_path);
+			return 1;
+		}
+	} else if (file_seek(store_fp, 0) != 0 || fread(header, STORE_HEADER_SIZE, 1, store_fp) != 1 ||
+		memcmp(header, STORE_MAGIC, 4)) {
+		fprintf(stderr, "FATAL: Invalid store file \"%s\" !\n", store_path);
+		return 1;
+	} else if (header[4] != STORE_VERSION) {
+		fprintf(stderr, "FATAL: Unsupported version %u for store file \"%s\" !\n", header[4], store_path);
+		return 1;
+	}
+
+	store_end = STORE_HEADER_SIZE;
+
+	return 0;
+}
+
+/* Indexes every complete record added since the last scan (by any
+ * process), a partially written one at the end (if any) being overwritten
+ * by the next record
+ */
+static bool_t scan_store(void)
+{
+	uint8_t header[STORE_RECORD_HEADER_SIZE];
+	uint64_t key, offset, file_size;
+	uint32_t pos, size;
+
+	if (fseek(store_fp, 0, SEEK_END) != 0 || (file_size = file_tell(store_fp)) < store_end ||
+		file_seek(store_fp, store_end) != 0) {
+		fprintf(stderr, "FATAL: Failed to read from store file \"%s\" !\n", store_path);
+		return 1;
+	}
+
+	while (store_end + STORE_RECORD_HEADER_SIZE <= file_size &&
+		fread(header, STORE_RECORD_HEADER_SIZE, 1, store_fp) == 1) {
+		pos = 0;
+		key = get_le(header, &pos, 8);
+		size = get_le(header, &pos, 4);
+		offset = store_end + STORE_RECORD_HEADER_SIZE;
+
+		if (size == 0 || size > STORE_MAX_RECORD_SIZE || offset + size > file_size ||
+			file_seek(store_fp, offset + size) != 0) {
+			break;
+		}
+
+		if (add_entry(key, offset, size)) {
+			return 1;
+		}
+
+		store_end = offset + size;
+	}
+
+	return 0;
+}
+
+/* Makes sure that the record of the given entry holds exactly this data */
+static bool_t check_data(entry_t *entry, uint8_t *data, uint32_t size)
+{
+	uint8_t buf[STORE_COMPARE_SIZE];
+	uint32_t pos, len;
+
+	if (entry->size == size && file_seek(store_fp, entry->offset) == 0) {
+		for (pos = 0; pos < size; pos += len) {
+			len = (size - pos < STORE_COMPARE_SIZE) ? size - pos : STORE_COMPARE_SIZE;
+			if (fread(buf, len, 1, store_fp) != 1 || memcmp(buf, data + pos, len)) {
+				break;
+			}
+		}
+
+		if (pos >= size) {
+			return 0;
+		}
+	}
+
+	fprintf(stderr, "FATAL: Data %016llX differs from the one in store \"%s\" !\n", (unsigned long long) entry->key, store_path);
+	return 1;
+}
+
+static bool_t append_data(uint8_t *data, uint32_t size, uint64_t key)
+{
+	uint8_t header[STORE_RECORD_HEADER_SIZE];
+	uint32_t pos = 0;
+
+	put_le(header, &pos, key, 8);
+	put_le(header, &pos, size, 4);
+	put_le(header, &pos, crc32_update(0, data, size), 4);
+
+	if (file_seek(store_fp, store_end) != 0 ||
+		fwrite(header, STORE_RECORD_HEADER_SIZE, 1, store_fp) != 1 ||
+		fwrite(data, size, 1, store_fp) != 1 || sync_file(store_fp)) {
+		fprintf(stderr, "FATAL: Failed to write to store file \"%s\" !\n", store_path);
+		return 1;
+	}
+
+	if (add_entry(key, store_end + STORE_RECORD_HEADER_SIZE, size)) {
+		return 1;
+	}
+
+	store_end += STORE_RECORD_HEADER_SIZE + size;
+
+	return 0;
+}
+
+/* Opens (or creates) the store. Opening the store that is already open
+ * does nothing, so that it can be done from any thread, when needed.
+ */
+bool_t store_open(char *path)
+{
+	bool_t ret = 0;
+
+	SDL_AtomicLock(&open_lock);
+
+	if (store_fp != NULL) {
+		if (strcmp(path, store_path)) {
+			fprintf(stderr, "FATAL: Cannot use store \"%s\" along with \"%s\" !\n", path, store_path);
+			ret = 1;
+		}
+
+		SDL_AtomicUnlock(&open_lock);
+		return ret;
+	}
+
+	strncpy(store_path, path, sizeof(store_path) - 1);
+
+	store_mutex = SDL_CreateMutex();
+	if (store_mutex == NULL) {
+		fprintf(stderr, "FATAL: Cannot create the store mutex !\n");
+		SDL_AtomicUnlock(&open_lock);
+		return 1;
+	}
+
+	entries = SDL_calloc(STORE_INDEX_MIN_SIZE, sizeof(entry_t));
+	if (entries == NULL) {
+		fprintf(stderr, "FATAL: Cannot allocate the store index !\n");
+		SDL_DestroyMutex(store_mutex);
+		store_mutex = NULL;
+		SDL_AtomicUnlock(&open_lock);
+		return 1;
+	}
+
+	entry_max = STORE_INDEX_MIN_SIZE;
+
+	/* Created without truncating, as another process may be creating it too */
+	store_fp = fopen(path, "r+b");
+	if (store_fp == NULL && (store_fp = fopen(path, "ab")) != NULL) {
+		fclose(store_fp);
+		store_fp = fopen(path, "r+b");
+	}
+
+	if (store_fp == NULL) {
+		fprintf(stderr, "FATAL: Cannot open store file \"%s\" !\n", path);
+		ret = 1;
+	} else if (lock_file()) {
+		ret = 1;
+	} else {
+		ret = (check_header() || scan_store());
+		unlock_file();
+	}
+
+	if (ret) {
+		if (store_fp != NULL) {
+			fclose(store_fp);
+			store_fp = NULL;
+		}
+
+		SDL_free(entries);
+		entries = NULL;
+		entry_num = entry_max = 0;
+		SDL_DestroyMutex(store_mutex);
+		store_mutex = NULL;
+	}
+
+	SDL_AtomicUnlock(&open_lock);
+
+	return ret;
+}
+
+void store_close(void)
+{
+	if (store_fp == NULL) {
+		return;
+	}
+
+	fclose(store_fp);
+	store_fp = NULL;
+
+	SDL_free(entries);
+	entries = NULL;
+	entry_num = entry_max = 0;
+
+	SDL_DestroyMutex(store_mutex);
+	store_mutex = NULL;
+}
+
+/* Stores data (if not already there) and gives its key. The data is on
+ * disk when this returns, so that it can be referenced right away.
+ */
+bool_t store_put(uint8_t *data, uint32_t size, uint64_t *key)
+{
+	entry_t *entry;
+	bool_t ret = 0;
+
+	if (store_fp == NULL || size == 0 || size > STORE_MAX_RECORD_SIZE) {
+		fprintf(stderr, "FATAL: Cannot store %u bytes !\n", size);
+		return 1;
+	}
+
+	*key = hash_data(data, size);
+
+	SDL_LockMutex(store_mutex);
+
+	entry = find_entry(*key);
+	if (entry->offset != 0) {
+		ret = check_data(entry, data, size);
+	} else if (lock_file()) {
+		ret = 1;
+	} else {
+		/* Another process may have stored it since the last scan */
+		ret = scan_store();
+		if (!ret) {
+			entry = find_entry(*key);
+			ret = (entry->offset != 0) ? check_data(entry, data, size) : append_data(data, size, *key);
+		}
+
+		unlock_file();
+	}
+
+	SDL_UnlockMutex(store_mutex);
+
+	return ret;
+}
+
+/* Reads back the data of the given key, which must be size bytes */
+bool_t store_get(uint64_t key, uint8_t *data, uint32_t size)
+{
+	uint8_t header[STORE_RECORD_HEADER_SIZE];
+	entry_t *entry;
+	uint32_t pos = 8 + 4;
+	bool_t ret = 0;
+
+	if (store_fp == NULL) {
+		fprintf(stderr, "FATAL: No store open !\n");
+		return 1;
+	}
+
+	SDL_LockMutex(store_mutex);
+
+	entry = find_entry(key);
+	if (entry->offset == 0 && !lock_file()) {
+		/* Maybe stored by another process since the last scan */
+		scan_store();
+		unlock_file();
+		entry = find_entry(key);
+	}
+
+	if (entry->offset == 0 || entry->size != size) {
+		fprintf(stderr, "FATAL: Missing data %016llX in store \"%s\" !\n", (unsigned long long) key, store_path);
+		ret = 1;
+	} else if (file_seek(store_fp, entry->offset - STORE_RECORD_HEADER_SIZE) != 0 ||
+		fread(header, STORE_RECORD_HEADER_SIZE, 1, store_fp) != 1 ||
+		fread(data, size, 1, store_fp) != 1) {
+		fprintf(stderr, "FATAL: Failed to read from store file \"%s\" !\n", store_path);
+		ret = 1;
+	} else if (get_le(header, &pos, 4) != crc32_update(0, data, size)) {
+		fprintf(stderr, "FATAL: Corrupted data %016llX in store \"%s\" !\n", (unsigned long long) key, store_path);
+		ret = 1;
+	}
+
+	SDL_UnlockMutex(store_mutex);
+
+	return ret;
+}
@@ -0,0 +1,35 @@
+/*
+ * TamaTool - A cross-platform Tamagotchi P1 explorer
+ *
+ * Copyright (C) 2021 Jean-Christophe Rona <jc@rona.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#ifndef _STORE_H_
+#define _STORE_H_
+
+#include <stdint.h>
+
+#include "hal_types.h"
+
+#define STORE_PATH			"saves.pack" // Default content-addressed store
+
+
+bool_t store_open(char *path);
+void store_close(void);
+bool_t store_put(uint8_t *data, uint32_t size, uint64_t *key);
+bool_t store_get(uint64_t key, uint8_t *data, uint32_t size);
+
+#endif /* _STORE_H_ */
@@ -41,6 +41,22 @@
 #include "program.h"
 #include "state.h"
 #include "mem_edit.h"
+#include "lcd.h"
+#include "record.h"
+#include "lockfree.h"
+#include "grid.h"
+#include "buzzer.h"
+#include "wav.h"
+#include "rewind.h"
+#include "autosave.h"
+#include "diff.h"
+#include "convert.h"
+#include "store.h"
+#include "live.h"
+#include "trace.h"
+#include "heatmap.h"
+#include "watch.h"
+#include "shadow.h"
 
 #define APP_NAME			"TamaTool"
 #define APP_VERSION			"0.1" // Major, minor
@@ -94,21 +110,64 @@
 #define AUDIO_FREQUENCY			48000
 #define AUDIO_SAMPLES			480 // 10 ms @ 48000 Hz
 #define AUDIO_VOLUME			0.2f
+#define AUDIO_QUEUE_SIZE		256 // Must be a power of 2
+#define AUDIO_MAX_DRIFT			100 // ms, beyond which the audio timeline is resynchronized
+
+/* tamalib reports each memory access as a LOG_MEMORY line (following one
+ * naming the memory region), with the value, the address and the PC
+ */
+#define MEMORY_READ_LOG				"Read "
+#define MEMORY_WRITE_LOG			"Write "
 
 #define MEM_FRAMERATE			30 // fps
 
+#define RENDER_FRAMERATE		60 // fps
+
+#define INPUT_QUEUE_SIZE		64 // Must be a power of 2
+
+#define GRID_PIXEL_SIZE			4
+#define GRID_TILE_PADDING		8
+#define GRID_TILE_WIDTH			(LCD_WIDTH * GRID_PIXEL_SIZE)
+#define GRID_TILE_HEIGHT		(LCD_HEIGHT * GRID_PIXEL_SIZE)
+#define GRID_COLOR_ON			0xFF000080 // ARGB
+#define GRID_COLOR_OFF			0xFFD8DCC8 // ARGB
+#define GRID_MAX_SLICE			1000000 // us of emulated time per frame at most
+
 /* Uncomment this line to be as close as possible
  * to a cycle-accurate emulation. The downside is that
  * the CPU load will be close to 100%.
  */
 //#define NO_SLEEP
 
+/* Comment this line to update the LCD pixel by pixel from the
+ * set_lcd_matrix()/set_lcd_icon() callbacks, instead of decoding
+ * the whole display memory at once, and only when it changed,
+ * when a frame is needed.
+ */
+#define LCD_BULK_UPDATE
+
 typedef enum {
 	SPEED_UNLIMITED = 0,
 	SPEED_1X = 1,
 	SPEED_10X = 10,
 } emulation_speed_t;
 
+/* Inputs sent by the render thread to the emulation thread */
+typedef enum {
+	INPUT_BUTTON,
+	INPUT_EXEC_MODE,
+	INPUT_SPEED,
+	INPUT_SAVE,
+	INPUT_LOAD,
+	INPUT_REWIND,
+} input_type_t;
+
+typedef struct {
+	input_type_t type;
+	u8_t arg0;
+	u8_t arg1;
+} input_t;
+
 static breakpoint_t *g_breakpoints = NULL;
 
 static u12_t *g_program = NULL;		// The actual program that is executed
@@ -127,12 +186,49 @@ static SDL_Rect bg_rect;
 
 static SDL_AudioSpec audio_spec;
 static SDL_AudioDeviceID audio_dev;
-static u32_t current_freq = 0; // in dHz
-static unsigned int sin_pos = 0;
-static bool_t is_audio_playing = 0;
+static buzzer_t buzzer;
+
+/* Buzzer changes are sent to the audio thread along with their emulated
+ * timestamp, so that they can be applied at the matching sample instead of
+ * at the next audio buffer boundary
+ */
+static buzzer_event_t audio_events[AUDIO_QUEUE_SIZE];
+static spsc_queue_t audio_queue;
+static bool_t audio_synced = 0;
+static u32_t audio_sync_tick; // Emulated tick matching audio_samples == 0
+static int64_t audio_samples; // Samples played since audio_sync_tick
+
+static bool_t screen_dirty = 1; // Forces a redraw even if the LCD did not change
+static uint32_t published_generation = 0; // LCD generation last sent to the render thread
+
+/* The emulation thread publishes LCD frames through a triple buffer, and
+ * receives inputs through a queue, so that neither side waits for the other
+ */
+static lcd_frame_t screen_slots[3];
+static triple_buffer_t screen_buffer;
+static input_t input_slots[INPUT_QUEUE_SIZE];
+static spsc_queue_t input_queue;
+static SDL_atomic_t quit_requested;
+static SDL_atomic_t emulation_running;
 
-static bool_t matrix_buffer[LCD_HEIGHT][LCD_WIDTH] = {{0}};
-static bool_t icon_buffer[ICON_NUM] = {0};
+static bool_t headless_enable = 0;
+static bool_t record_enable = 0;
+static bool_t wav_enable = 0;
+static bool_t rewind_enable = 0;
+
+/* Last buzzer settings, which seed the WAV renderer when it starts */
+static u32_t buzzer_frequency = 0;
+static bool_t buzzer_playing = 0;
+
+static bool_t memory_hooks_enable = 0; // Memory accesses are needed by the host
+static bool_t heatmap_enable = 0;
+
+static uint64_t autosave_interval = 0; // In ticks, 0 disables the periodic autosave
+static uint64_t last_autosave_ticks = 0;
+
+static uint64_t emulated_ticks = 0; // Emulated time since the start, in ticks
+static u32_t last_tick_counter = 0;
+static uint64_t emulated_ticks_limit = 0; // 0 means no limit
 
 static u8_t log_levels = LOG_ERROR | LOG_INFO;
 
@@ -147,12 +243,18 @@ static uint16_t pixel_alpha_on, pixel_alpha_off, icon_alpha_on, icon_alpha_off;
 static uint16_t buttons_x, buttons_y, buttons_width, buttons_height;
 static bool_t shell_enable = 1;
 
+static uint32_t grid_num = 0; // 0 means a single pet
+static uint32_t grid_cols, grid_rows;
+static SDL_Texture *grid_atlas = NULL;
+
 #if defined(__WIN32__)
 static LARGE_INTEGER counter_freq;
 #endif
 
 static void sdl_release(void);
 static bool_t sdl_init(void);
+static bool_t sdl_load_shell(void);
+static void sdl_apply_layout(void);
 
 
 static void * hal_malloc(u32_t size)
@@ -172,13 +274,73 @@ static void hal_halt(void)
 
 static bool_t hal_is_log_enabled(log_level_t level)
 {
-	return !!(log_levels & level);
+	return !!(log_levels & level) || (level == LOG_MEMORY && memory_hooks_enable);
+}
+
+static void hal_log(log_level_t level, char *buff, ...);
+
+/* Stops after the current instruction, the way breakpoints do */
+static void on_watchpoint_hit(char *access, u4_t value, u12_t addr, u4_t old_value, u13_t pc)
+{
+	tamalib_set_exec_mode(EXEC_MODE_STEP);
+	hal_log(LOG_INFO, "Watchpoint hit: %s 0x%X at 0x%03X (was 0x%X) - PC = 0x%04X\n", access, value, addr, old_value, pc);
+}
+
+static void on_memory_access(char *buff, va_list arglist)
+{
+	u4_t value, old_value;
+	u12_t addr;
+	u13_t pc;
+
+	if (!strncmp(buff, MEMORY_WRITE_LOG, sizeof(MEMORY_WRITE_LOG) - 1)) {
+		value = va_arg(arglist, unsigned int);
+		addr = va_arg(arglist, unsigned int);
+		pc = va_arg(arglist, unsigned int);
+
+		old_value = shadow_swap(addr, value);
+		trace_write(*(tamalib_get_state()->tick_counter), pc, addr, old_value, value);
+		if (heatmap_enable) {
+			heatmap_write(addr);
+		}
+		if (watch_write(addr, old_value, value) != NULL) {
+			on_watchpoint_hit("Write", value, addr, old_value, pc);
+		}
+	} else if (!strncmp(buff, MEMORY_READ_LOG, sizeof(MEMORY_READ_LOG) - 1)) {
+		value = va_arg(arglist, unsigned int);
+		addr = va_arg(arglist, unsigned int);
+		pc = va_arg(arglist, unsigned int);
+
+		shadow_set(addr, value);
+		if (heatmap_enable) {
+			heatmap_read(addr);
+		}
+		if (watch_read(addr) != NULL) {
+			on_watchpoint_hit("Read", value, addr, value, pc);
+		}
+	}
+}
+
+/* To be called once the memory has been changed behind the emulation
+ * (state loading, rewinding), for the next writes to report the right
+ * old values
+ */
+static void sync_memory_shadow(void)
+{
+	if (memory_hooks_enable) {
+		shadow_sync(tamalib_get_state()->memory);
+	}
 }
 
 static void hal_log(log_level_t level, char *buff, ...)
 {
 	va_list arglist;
 
+	if (level == LOG_MEMORY && memory_hooks_enable) {
+		va_start(arglist, buff);
+		on_memory_access(buff, arglist);
+		va_end(arglist);
+	}
+
 	if (!(log_levels & level)) {
 		return;
 	}
@@ -231,9 +393,39 @@ static void hal_sleep_until(timestamp_t ts)
 }
 
 static void hal_update_screen(void)
+{
+	if (headless_enable) {
+		return;
+	}
+
+	/* Only publish frames that changed */
+	lcd_commit();
+	if (lcd_get_generation() == published_generation) {
+		return;
+	}
+
+	published_generation = lcd_get_generation();
+
+	memcpy(triple_buffer_get_back(&screen_buffer), lcd_get_frame(), sizeof(lcd_frame_t));
+	triple_buffer_publish(&screen_buffer);
+}
+
+/* Runs in the render thread */
+static void render_screen(void)
 {
 	unsigned int i, j;
 	SDL_Rect r, src_icon_r, dest_icon_r;
+	const lcd_frame_t *frame;
+	bool_t fresh;
+
+	frame = triple_buffer_get_front(&screen_buffer, &fresh);
+
+	/* Nothing to do if neither the LCD nor the window changed */
+	if (!fresh && !screen_dirty) {
+		return;
+	}
+
+	screen_dirty = 0;
 
 	SDL_RenderCopy(renderer, bg, NULL, &bg_rect);
 
@@ -245,7 +437,7 @@ static void hal_update_screen(void)
 			r.x = i * pixel_stride + lcd_offset_x + bg_offset_x;
 			r.y = j * pixel_stride + lcd_offset_y + bg_offset_y;
 
-			if (matrix_buffer[j][i]) {
+			if (LCD_FRAME_PIXEL(frame, i, j)) {
 				SDL_SetRenderDrawColor(renderer, 0, 0, 128, pixel_alpha_on);
 			} else {
 				SDL_SetRenderDrawColor(renderer, 0, 0, 128, pixel_alpha_off);
@@ -269,7 +461,7 @@ static void hal_update_screen(void)
 
 
 		SDL_SetTextureColorMod(icons, 0, 0, 128);
-		if (icon_buffer[i]) {
+		if (LCD_FRAME_ICON(frame, i)) {
 			SDL_SetTextureAlphaMod(icons, icon_alpha_on);
 		} else {
 			SDL_SetTextureAlphaMod(icons, icon_alpha_off);
@@ -278,34 +470,84 @@ static void hal_update_screen(void)
 		SDL_RenderCopy(renderer, icons, &src_icon_r, &dest_icon_r);
 	}
 
-	SDL_RenderCopy(renderer, shell, NULL, &shell_rect);
+	if (shell_enable) {
+		SDL_RenderCopy(renderer, shell, NULL, &shell_rect);
+	}
 
 	SDL_RenderPresent(renderer);
 }
 
 static void hal_set_lcd_matrix(u8_t x, u8_t y, bool_t val)
 {
-	matrix_buffer[y][x] = val;
+#ifdef LCD_BULK_UPDATE
+	lcd_invalidate();
+#else
+	lcd_set_pixel(x, y, val);
+#endif
 }
 
 static void hal_set_lcd_icon(u8_t icon, bool_t val)
 {
-	icon_buffer[icon] = val;
+#ifdef LCD_BULK_UPDATE
+	lcd_invalidate();
+#else
+	lcd_set_icon(icon, val);
+#endif
 }
 
-static void hal_set_frequency(u32_t freq)
+static void update_emulated_time(void)
 {
-	if (current_freq != freq) {
-		current_freq = freq;
-		sin_pos = 0;
+	u32_t tick_counter = *(tamalib_get_state()->tick_counter);
+
+	/* Ignore backward jumps (state loading) */
+	if ((int32_t) (tick_counter - last_tick_counter) > 0) {
+		emulated_ticks += tick_counter - last_tick_counter;
 	}
+
+	last_tick_counter = tick_counter;
 }
 
-static void hal_play_frequency(bool_t en)
+static void push_audio_event(buzzer_event_type_t type, u32_t value)
 {
-	if (is_audio_playing != en) {
-		is_audio_playing = en;
+	buzzer_event_t ev;
+
+	/* Only the focused pet is heard in grid mode */
+	if (grid_num && !grid_is_focus_loaded()) {
+		return;
+	}
+
+	ev.tick = *(tamalib_get_state()->tick_counter);
+	ev.type = type;
+	ev.value = value;
+
+	if (type == BUZZER_EVENT_FREQUENCY) {
+		buzzer_frequency = value;
+	} else {
+		buzzer_playing = (bool_t) value;
 	}
+
+	if (wav_enable) {
+		update_emulated_time();
+		wav_event(emulated_ticks, &ev);
+	}
+
+	/* Nothing is heard in headless mode */
+	if (headless_enable) {
+		return;
+	}
+
+	/* If the audio thread does not keep up, the change is simply lost */
+	spsc_queue_push(&audio_queue, &ev);
+}
+
+static void hal_set_frequency(u32_t freq)
+{
+	push_audio_event(BUZZER_EVENT_FREQUENCY, freq);
+}
+
+static void hal_play_frequency(bool_t en)
+{
+	push_audio_event(BUZZER_EVENT_PLAY, en);
 }
 
 static void compute_layout(void)
@@ -350,27 +592,74 @@ static void compute_layout(void)
 	buttons_height = (lcd_size * REF_BUTTONS_HEIGHT)/REF_LCD_SIZE;
 }
 
+static void send_input(input_type_t type, u8_t arg0, u8_t arg1)
+{
+	input_t input = { type, arg0, arg1 };
+
+	if (spsc_queue_push(&input_queue, &input)) {
+		hal_log(LOG_ERROR, "Input queue full, event dropped !\n");
+	}
+}
+
+static void handle_input(input_t *input)
+{
+	char save_path[256];
+
+	switch (input->type) {
+		case INPUT_BUTTON:
+			tamalib_set_button((button_t) input->arg0, (btn_state_t) input->arg1);
+			break;
+
+		case INPUT_EXEC_MODE:
+			tamalib_set_exec_mode((exec_mode_t) input->arg0);
+			break;
+
+		case INPUT_SPEED:
+			tamalib_set_speed(input->arg0);
+			break;
+
+		case INPUT_SAVE:
+			/* Encoded and written in the background */
+			autosave_request(emulated_ticks, 0);
+			break;
+
+		case INPUT_LOAD:
+			autosave_flush();
+			state_find_last_name(save_path);
+			if (save_path[0]) {
+				state_load(save_path);
+				sync_memory_shadow();
+			}
+			break;
+
+		case INPUT_REWIND:
+			if (rewind_enable && !rewind_step_back()) {
+				lcd_invalidate();
+				sync_memory_shadow();
+			}
+			break;
+	}
+}
+
 static void handle_click(int32_t x, int32_t y, uint8_t pressed) {
 	if (y >= buttons_y && y < buttons_y + buttons_height) {
 		if (x < buttons_x) {
 			/* Nothing */
 		} else if (x < buttons_x + buttons_width/3) {
 			/* Left button */
-			tamalib_set_button(BTN_LEFT, pressed ? BTN_STATE_PRESSED : BTN_STATE_RELEASED);
+			send_input(INPUT_BUTTON, BTN_LEFT, pressed ? BTN_STATE_PRESSED : BTN_STATE_RELEASED);
 		} else if (x < buttons_x + (buttons_width * 2)/3) {
 			/* Middle button */
-			tamalib_set_button(BTN_MIDDLE, pressed ? BTN_STATE_PRESSED : BTN_STATE_RELEASED);
+			send_input(INPUT_BUTTON, BTN_MIDDLE, pressed ? BTN_STATE_PRESSED : BTN_STATE_RELEASED);
 		} else if (x < buttons_x + buttons_width) {
 			/* Right button */
-			tamalib_set_button(BTN_RIGHT, pressed ? BTN_STATE_PRESSED : BTN_STATE_RELEASED);
+			send_input(INPUT_BUTTON, BTN_RIGHT, pressed ? BTN_STATE_PRESSED : BTN_STATE_RELEASED);
 		}
 	}
 }
 
 static int handle_sdl_events(SDL_Event *event)
 {
-	char save_path[256];
-
 	switch(event->type) {
 		case SDL_QUIT:
 			return 1;
@@ -378,6 +667,8 @@ static int handle_sdl_events(SDL_Event *event)
 		case SDL_WINDOWEVENT:
 			switch (event->window.event) {
 				case SDL_WINDOWEVENT_SIZE_CHANGED:
+				case SDL_WINDOWEVENT_EXPOSED:
+					screen_dirty = 1;
 					break;
 			}
 			break;
@@ -424,23 +715,23 @@ static int handle_sdl_events(SDL_Event *event)
 					return 1;
 
 				case SDLK_r:
-					tamalib_set_exec_mode(EXEC_MODE_RUN);
+					send_input(INPUT_EXEC_MODE, EXEC_MODE_RUN, 0);
 					break;
 
 				case SDLK_s:
-					tamalib_set_exec_mode(EXEC_MODE_STEP);
+					send_input(INPUT_EXEC_MODE, EXEC_MODE_STEP, 0);
 					break;
 
 				case SDLK_w:
-					tamalib_set_exec_mode(EXEC_MODE_NEXT);
+					send_input(INPUT_EXEC_MODE, EXEC_MODE_NEXT, 0);
 					break;
 
 				case SDLK_x:
-					tamalib_set_exec_mode(EXEC_MODE_TO_CALL);
+					send_input(INPUT_EXEC_MODE, EXEC_MODE_TO_CALL, 0);
 					break;
 
 				case SDLK_c:
-					tamalib_set_exec_mode(EXEC_MODE_TO_RET);
+					send_input(INPUT_EXEC_MODE, EXEC_MODE_TO_RET, 0);
 					break;
 
 				case SDLK_f:
@@ -458,19 +749,19 @@ static int handle_sdl_events(SDL_Event *event)
 							break;
 					}
 
-					tamalib_set_speed((u8_t) speed);
+					send_input(INPUT_SPEED, (u8_t) speed, 0);
 					break;
 
 				case SDLK_b:
-					state_find_next_name(save_path);
-					state_save(save_path, SDL_FALSE);
+					send_input(INPUT_SAVE, 0, 0);
 					break;
 
 				case SDLK_n:
-					state_find_last_name(save_path);
-					if (save_path[0]) {
-						state_load(save_path);
-					}
+					send_input(INPUT_LOAD, 0, 0);
+					break;
+
+				case SDLK_BACKSPACE:
+					send_input(INPUT_REWIND, 0, 0);
 					break;
 
 				case SDLK_i:
@@ -478,10 +769,9 @@ static int handle_sdl_events(SDL_Event *event)
 						break;
 					}
 
-					sdl_release();
 					pixel_stride++;
 					compute_layout();
-					sdl_init();
+					sdl_apply_layout();
 					break;
 
 				case SDLK_d:
@@ -489,29 +779,31 @@ static int handle_sdl_events(SDL_Event *event)
 						break;
 					}
 
-					sdl_release();
 					pixel_stride--;
 					compute_layout();
-					sdl_init();
+					sdl_apply_layout();
 					break;
 
 				case SDLK_t:
-					sdl_release();
+					if (!shell_enable && sdl_load_shell()) {
+						break;
+					}
+
 					shell_enable = !shell_enable;
 					compute_layout();
-					sdl_init();
+					sdl_apply_layout();
 					break;
 
 				case SDLK_LEFT:
-					tamalib_set_button(BTN_LEFT, BTN_STATE_PRESSED);
+					send_input(INPUT_BUTTON, BTN_LEFT, BTN_STATE_PRESSED);
 					break;
 
 				case SDLK_DOWN:
-					tamalib_set_button(BTN_MIDDLE, BTN_STATE_PRESSED);
+					send_input(INPUT_BUTTON, BTN_MIDDLE, BTN_STATE_PRESSED);
 					break;
 
 				case SDLK_RIGHT:
-					tamalib_set_button(BTN_RIGHT, BTN_STATE_PRESSED);
+					send_input(INPUT_BUTTON, BTN_RIGHT, BTN_STATE_PRESSED);
 					break;
 			}
 			break;
@@ -519,15 +811,15 @@ static int handle_sdl_events(SDL_Event *event)
 		case SDL_KEYUP:
 			switch (event->key.keysym.sym) {
 				case SDLK_LEFT:
-					tamalib_set_button(BTN_LEFT, BTN_STATE_RELEASED);
+					send_input(INPUT_BUTTON, BTN_LEFT, BTN_STATE_RELEASED);
 					break;
 
 				case SDLK_DOWN:
-					tamalib_set_button(BTN_MIDDLE, BTN_STATE_RELEASED);
+					send_input(INPUT_BUTTON, BTN_MIDDLE, BTN_STATE_RELEASED);
 					break;
 
 				case SDLK_RIGHT:
-					tamalib_set_button(BTN_RIGHT, BTN_STATE_RELEASED);
+					send_input(INPUT_BUTTON, BTN_RIGHT, BTN_STATE_RELEASED);
 					break;
 			}
 			break;
@@ -538,9 +830,30 @@ static int handle_sdl_events(SDL_Event *event)
 
 static int hal_handler(void)
 {
-	SDL_Event event;
+	input_t input;
 	timestamp_t ts;
 
+	update_emulated_time();
+
+	if (record_enable) {
+		record_poll(emulated_ticks);
+	}
+
+	if (rewind_enable) {
+		rewind_poll(emulated_ticks);
+	}
+
+	if (autosave_interval && emulated_ticks - last_autosave_ticks >= autosave_interval) {
+		last_autosave_ticks = emulated_ticks;
+		autosave_request(emulated_ticks, 1);
+	}
+
+	live_poll();
+
+	if (emulated_ticks_limit && emulated_ticks >= emulated_ticks_limit) {
+		return 1;
+	}
+
 	if (memory_editor_enable) {
 		/* Dump memory @ 30 fps */
 		ts = hal_get_timestamp();
@@ -550,10 +863,16 @@ static int hal_handler(void)
 		}
 	}
 
-	while (SDL_PollEvent(&event)) {
-		if (handle_sdl_events(&event)) {
-			return 1;
-		}
+	if (headless_enable) {
+		return 0;
+	}
+
+	if (SDL_AtomicGet(&quit_requested)) {
+		return 1;
+	}
+
+	while (!spsc_queue_pop(&input_queue, &input)) {
+		handle_input(&input);
 	}
 
 	return 0;
@@ -577,35 +896,109 @@ static hal_t hal = {
 
 static void audio_callback(void *userdata, Uint8 *stream, int len)
 {
-	unsigned int i;
-	int samples = len / sizeof(float);
+	float *samples = (float *) stream;
+	int64_t num = len / sizeof(float);
+	int64_t max_drift = ((int64_t) buzzer.sample_rate * AUDIO_MAX_DRIFT) / 1000;
+	int64_t pos = 0, offset;
+	buzzer_event_t ev;
+
+	while (!spsc_queue_peek(&audio_queue, &ev)) {
+		/* Position of the event relative to the start of this buffer */
+		offset = ((int64_t) (int32_t) (ev.tick - audio_sync_tick) * buzzer.sample_rate) / EMU_TICK_FREQUENCY - audio_samples;
+
+		if (!audio_synced || offset < -max_drift || offset > num + max_drift) {
+			/* (Re)anchor the timeline so that this event is played one
+			 * buffer from now, which absorbs the emulation jitter
+			 */
+			audio_sync_tick = ev.tick;
+			audio_samples = -num;
+			audio_synced = 1;
+			offset = num;
+		}
 
-	if (is_audio_playing) {
-		/* Generate the required frequency */
-		for (i = 0; i < samples; i++) {
-			((float *) stream)[i] = AUDIO_VOLUME * SDL_sinf(2 * M_PI * (i + sin_pos) * current_freq / (AUDIO_FREQUENCY * 10));
+		if (offset >= num) {
+			/* Belongs to a later buffer */
+			break;
 		}
 
-		sin_pos = (sin_pos + samples) % (AUDIO_FREQUENCY * 10);
-	} else {
-		/* No sound */
-		SDL_memset(stream, 0, len);
-		sin_pos = 0;
+		if (offset > pos) {
+			buzzer_fill(&buzzer, samples + pos, offset - pos, AUDIO_VOLUME);
+			pos = offset;
+		}
+
+		buzzer_apply(&buzzer, &ev);
+		spsc_queue_pop(&audio_queue, &ev);
 	}
 
+	buzzer_fill(&buzzer, samples + pos, num - pos, AUDIO_VOLUME);
+	audio_samples += num;
+
+	/* Once silent and idle, the next event starts a fresh timeline */
+	if (!buzzer.playing && spsc_queue_peek(&audio_queue, &ev)) {
+		audio_synced = 0;
+	}
 }
 
 static void sdl_release(void)
 {
+	if (audio_dev) {
+		SDL_CloseAudioDevice(audio_dev);
+		audio_dev = 0;
+	}
+
 	SDL_DestroyTexture(icons);
+	SDL_DestroyTexture(shell);
 	SDL_DestroyTexture(bg);
+	icons = shell = bg = NULL;
 
 	IMG_Quit();
 
+	SDL_DestroyRenderer(renderer);
 	SDL_DestroyWindow(window);
+	renderer = NULL;
+	window = NULL;
+
 	SDL_Quit();
 }
 
+static void sdl_apply_layout(void)
+{
+	/* Textures are scaled at render time, so a layout change only needs
+	 * the window and the destination rectangles to be updated
+	 */
+	SDL_SetWindowSize(window, (shell_enable ? shell_width : bg_size), (shell_enable ? shell_height : bg_size));
+
+	bg_rect.x = bg_offset_x;
+	bg_rect.y = bg_offset_y;
+	bg_rect.w = bg_size;
+	bg_rect.h = bg_size;
+
+	shell_rect.x = 0;
+	shell_rect.y = 0;
+	shell_rect.w = shell_width;
+	shell_rect.h = shell_height;
+
+	screen_dirty = 1;
+}
+
+/* The shell is only loaded when it is first shown, and then kept
+ * so that it can be toggled without decoding it again
+ */
+static bool_t sdl_load_shell(void)
+{
+	if (shell) {
+		return 0;
+	}
+
+	shell = IMG_LoadTexture(renderer, SHELL_PATH);
+	if(!shell) {
+		hal_log(LOG_ERROR, "Failed to load the shell image: %s\n", SDL_GetError());
+		return 1;
+	}
+
+	return 0;
+}
+
 static bool_t sdl_init(void)
 {
 	if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_EVENTS | SDL_INIT_AUDIO) != 0) {
@@ -632,13 +1025,9 @@ static bool_t sdl_init(void)
 		return 1;
 	}
 
-	if (shell_enable) {
-		shell = IMG_LoadTexture(renderer, SHELL_PATH);
-		if(!shell) {
-			hal_log(LOG_ERROR, "Failed to load the shell image: %s\n", SDL_GetError());
-			sdl_release();
-			return 1;
-		}
+	if (shell_enable && sdl_load_shell()) {
+		sdl_release();
+		return 1;
 	}
 
 	icons = IMG_LoadTexture(renderer, ICONS_PATH);
@@ -648,15 +1037,7 @@ static bool_t sdl_init(void)
 		return 1;
 	}
 
-	bg_rect.x = bg_offset_x;
-	bg_rect.y = bg_offset_y;
-	bg_rect.w = bg_size;
-	bg_rect.h = bg_size;
-
-	shell_rect.x = 0;
-	shell_rect.y = 0;
-	shell_rect.w = shell_width;
-	shell_rect.h = shell_height;
+	sdl_apply_layout();
 
 	SDL_memset(&audio_spec, 0, sizeof(audio_spec));
 	audio_spec.freq = AUDIO_FREQUENCY;
@@ -672,11 +1053,263 @@ static bool_t sdl_init(void)
 		return 1;
 	}
 
+	buzzer_init(&buzzer, audio_spec.freq);
+
 	SDL_PauseAudioDevice(audio_dev, SDL_FALSE);
 
 	return 0;
 }
 
+static int emulation_thread(void *data)
+{
+	tamalib_mainloop();
+
+	SDL_AtomicSet(&emulation_running, 0);
+
+	return 0;
+}
+
+/* Run the emulation in its own thread, while this one handles
+ * the SDL events and the rendering
+ */
+static bool_t run_threaded(void)
+{
+	SDL_Thread *thread;
+	SDL_Event event;
+
+	triple_buffer_init(&screen_buffer, screen_slots, sizeof(lcd_frame_t));
+	spsc_queue_init(&input_queue, input_slots, sizeof(input_t), INPUT_QUEUE_SIZE);
+	SDL_AtomicSet(&quit_requested, 0);
+	SDL_AtomicSet(&emulation_running, 1);
+
+	thread = SDL_CreateThread(&emulation_thread, "emulation", NULL);
+	if (thread == NULL) {
+		hal_log(LOG_ERROR, "Failed to create the emulation thread: %s\n", SDL_GetError());
+		return 1;
+	}
+
+	while (SDL_AtomicGet(&emulation_running)) {
+		if (SDL_WaitEventTimeout(&event, 1000/RENDER_FRAMERATE)) {
+			do {
+				if (handle_sdl_events(&event)) {
+					SDL_AtomicSet(&quit_requested, 1);
+				}
+			} while (SDL_PollEvent(&event));
+		}
+
+		render_screen();
+	}
+
+	SDL_WaitThread(thread, NULL);
+
+	return 0;
+}
+
+static void grid_tile_rect(uint32_t pet, SDL_Rect *r)
+{
+	r->x = GRID_TILE_PADDING + (pet % grid_cols) * (GRID_TILE_WIDTH + GRID_TILE_PADDING);
+	r->y = GRID_TILE_PADDING + (pet / grid_cols) * (GRID_TILE_HEIGHT + GRID_TILE_PADDING);
+	r->w = GRID_TILE_WIDTH;
+	r->h = GRID_TILE_HEIGHT;
+}
+
+static void handle_grid_click(int32_t x, int32_t y)
+{
+	SDL_Rect r;
+	uint32_t i;
+
+	for (i = 0; i < grid_num; i++) {
+		grid_tile_rect(i, &r);
+		if (x >= r.x && x < r.x + r.w && y >= r.y && y < r.y + r.h) {
+			grid_set_focus(i);
+			break;
+		}
+	}
+}
+
+static int handle_grid_events(SDL_Event *event)
+{
+	char save_path[256];
+
+	switch(event->type) {
+		case SDL_QUIT:
+			return 1;
+
+		case SDL_MOUSEBUTTONDOWN:
+			if (event->button.button == SDL_BUTTON_LEFT) {
+				handle_grid_click(event->button.x, event->button.y);
+			}
+			break;
+
+		case SDL_KEYDOWN:
+			switch (event->key.keysym.sym) {
+				case SDLK_AC_BACK:
+				case SDLK_ESCAPE:
+				case SDLK_q:
+					return 1;
+
+				case SDLK_TAB:
+					grid_set_focus((grid_get_focus() + 1) % grid_num);
+					break;
+
+				case SDLK_b:
+					grid_load_focus();
+					autosave_request(emulated_ticks, 0);
+					break;
+
+				case SDLK_n:
+					grid_load_focus();
+					autosave_flush();
+					state_find_last_name(save_path);
+					if (save_path[0]) {
+						state_load(save_path);
+						sync_memory_shadow();
+					}
+					break;
+
+				case SDLK_LEFT:
+					grid_set_button(BTN_LEFT, BTN_STATE_PRESSED);
+					break;
+
+				case SDLK_DOWN:
+					grid_set_button(BTN_MIDDLE, BTN_STATE_PRESSED);
+					break;
+
+				case SDLK_RIGHT:
+					grid_set_button(BTN_RIGHT, BTN_STATE_PRESSED);
+					break;
+			}
+			break;
+
+		case SDL_KEYUP:
+			switch (event->key.keysym.sym) {
+				case SDLK_LEFT:
+					grid_set_button(BTN_LEFT, BTN_STATE_RELEASED);
+					break;
+
+				case SDLK_DOWN:
+					grid_set_button(BTN_MIDDLE, BTN_STATE_RELEASED);
+					break;
+
+				case SDLK_RIGHT:
+					grid_set_button(BTN_RIGHT, BTN_STATE_RELEASED);
+					break;
+			}
+			break;
+	}
+
+	return 0;
+}
+
+/* All the tiles are uploaded to a single atlas texture, then drawn
+ * with one copy each
+ */
+static void render_grid(void)
+{
+	lcd_frame_t frame;
+	SDL_Rect src, dest;
+	uint32_t *pixels;
+	int pitch;
+	uint32_t i, x, y;
+
+	if (SDL_LockTexture(grid_atlas, NULL, (void **) &pixels, &pitch) == 0) {
+		for (i = 0; i < grid_num; i++) {
+			grid_get_frame(i, &frame);
+
+			for (y = 0; y < LCD_HEIGHT; y++) {
+				uint32_t *row = pixels + ((i / grid_cols) * LCD_HEIGHT + y) * (pitch / 4) + (i % grid_cols) * LCD_WIDTH;
+
+				for (x = 0; x < LCD_WIDTH; x++) {
+					row[x] = LCD_FRAME_PIXEL(&frame, x, y) ? GRID_COLOR_ON : GRID_COLOR_OFF;
+				}
+			}
+		}
+
+		SDL_UnlockTexture(grid_atlas);
+	}
+
+	SDL_SetRenderDrawColor(renderer, 0x40, 0x40, 0x40, 255);
+	SDL_RenderClear(renderer);
+
+	for (i = 0; i < grid_num; i++) {
+		src.x = (i % grid_cols) * LCD_WIDTH;
+		src.y = (i / grid_cols) * LCD_HEIGHT;
+		src.w = LCD_WIDTH;
+		src.h = LCD_HEIGHT;
+
+		grid_tile_rect(i, &dest);
+		SDL_RenderCopy(renderer, grid_atlas, &src, &dest);
+	}
+
+	/* Focused pet */
+	grid_tile_rect(grid_get_focus(), &dest);
+	dest.x -= GRID_TILE_PADDING/2;
+	dest.y -= GRID_TILE_PADDING/2;
+	dest.w += GRID_TILE_PADDING;
+	dest.h += GRID_TILE_PADDING;
+	SDL_SetRenderDrawColor(renderer, 0xFF, 0xC0, 0x00, 255);
+	SDL_RenderDrawRect(renderer, &dest);
+
+	SDL_RenderPresent(renderer);
+}
+
+/* Run several pets side by side, time-sliced on the single tamalib CPU.
+ * The grid paces the emulation itself, so tamalib runs at unlimited speed.
+ */
+static bool_t run_grid(void)
+{
+	SDL_Event event;
+	timestamp_t ts, last_ts;
+	uint32_t elapsed, ticks;
+	bool_t quit = 0;
+
+	for (grid_cols = 1; grid_cols * grid_cols < grid_num; grid_cols++);
+	grid_rows = (grid_num + grid_cols - 1) / grid_cols;
+
+	SDL_SetWindowSize(window, GRID_TILE_PADDING + grid_cols * (GRID_TILE_WIDTH + GRID_TILE_PADDING),
+			GRID_TILE_PADDING + grid_rows * (GRID_TILE_HEIGHT + GRID_TILE_PADDING));
+
+	grid_atlas = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, grid_cols * LCD_WIDTH, grid_rows * LCD_HEIGHT);
+	if (grid_atlas == NULL) {
+		hal_log(LOG_ERROR, "Failed to create the grid texture: %s\n", SDL_GetError());
+		return 1;
+	}
+
+	tamalib_set_speed(SPEED_UNLIMITED);
+
+	last_ts = hal_get_timestamp();
+
+	while (!quit) {
+		while (SDL_PollEvent(&event)) {
+			if (handle_grid_events(&event)) {
+				quit = 1;
+			}
+		}
+
+		ts = hal_get_timestamp();
+		elapsed = ts - last_ts;
+		last_ts = ts;
+
+		if (elapsed > GRID_MAX_SLICE) {
+			elapsed = GRID_MAX_SLICE;
+		}
+
+		/* Every pet runs for the same emulated time */
+		ticks = ((uint64_t) elapsed * EMU_TICK_FREQUENCY) / 1000000;
+		grid_run_for(ticks);
+		emulated_ticks += ticks;
+
+		render_grid();
+
+		hal_sleep_until(ts + 1000000/RENDER_FRAMERATE);
+	}
+
+	SDL_DestroyTexture(grid_atlas);
+	grid_atlas = NULL;
+
+	return 0;
+}
+
 void rom_not_found_msg(void)
 {
 #if defined(__WIN32__)
@@ -699,19 +1332,41 @@ static void usage(FILE * fp, int argc, char **argv)
 		"\t-M | --modify <path>          PNG file to use when modifying the data/sprites of a ROM\n"
 		"\t-H | --header                 Generate a header file from the ROM (written to STDOUT)\n"
 		"\t-l | --load <path>            Load the given memory state file (save)\n"
+		"\t-d | --delta                  Only save what changed since the previous save (b key, autosave)\n"
+		"\t-C | --compact <path>         Fold the given delta state file into a full one\n"
+		"\t-S | --store[=<path>]         Save full states to a deduplicating store (default is %s)\n"
+		"\t-D | --diff <path> <paths...> Compare the given state files with the first one\n"
+		"\t-X | --convert <format> <src> <dst>\n"
+		"\t                              Convert the state files of a directory to full or small\n"
+		"\t-A | --autosave <minutes>     Save every given emulated minutes, and on exit\n"
+		"\t-L | --live <path>            Keep the state in the given mapped file, restored on start\n"
+		"\t-I | --sync <ms>              Time between two syncs of the live state file (default is %u)\n"
+		"\t-R | --record <path>          Record every LCD frame to a .y4m, .pbm or .png (APNG) file\n"
+		"\t-a | --audio <path>           Render the buzzer to a .wav file, in emulated time\n"
+		"\t-n | --headless               Run without window nor audio, at unlimited speed\n"
+		"\t-t | --time <seconds>         Stop after the given emulated time\n"
+		"\t-g | --grid <num>             Show num pets in a grid (Tab or click to focus one)\n"
+		"\t                              starting from the saves given with -l (one each), if any\n"
 		"\t-s | --step                   Enable step by step debugging from the start\n"
 		"\t-b | --break <0xXXX>          Add a breakpoint\n"
+		"\t-k | --watch <0xXXX[-0xXXX][:r|:w|:c|:=0xX]>\n"
+		"\t                              Add a watchpoint on reads, writes (default), changes or\n"
+		"\t                              writes of the given value\n"
 		"\t-m | --memory                 Show memory access\n"
+		"\t-w | --trace <ranges>         Keep the history of the writes to the given addresses\n"
+		"\t                              (\"0x000-0x27F,0xF40\" or \"all\")\n"
+		"\t-W | --trace-out <path>       Write the history of the traced writes on exit\n"
 #if !defined(__WIN32__)
 		"\t-e | --editor                 Realtime memory editor\n"
+		"\t-x | --heatmap                Show the memory reads and writes in the editor\n"
 #endif
 		"\t-c | --cpu                    Show CPU related information\n"
 		"\t-v | --verbose                Show all information\n"
 		"\t-h | --help                   Print this message\n",
-		argv[0], ROM_PATH);
+		argv[0], ROM_PATH, STORE_PATH, LIVE_SYNC_INTERVAL);
 }
 
-static const char short_options[] = "r:E:M:Hl:sb:mecvh";
+static const char short_options[] = "r:E:M:Hl:dC:S::D:X:A:L:I:w:W:xk:R:a:nt:g:sb:mecvh";
 
 static const struct option long_options[] = {
 	{"rom", required_argument, NULL, 'r'},
@@ -719,10 +1374,27 @@ static const struct option long_options[] = {
 	{"modify", required_argument, NULL, 'M'},
 	{"header", no_argument, NULL, 'H'},
 	{"load", required_argument, NULL, 'l'},
+	{"delta", no_argument, NULL, 'd'},
+	{"compact", required_argument, NULL, 'C'},
+	{"store", optional_argument, NULL, 'S'},
+	{"diff", required_argument, NULL, 'D'},
+	{"convert", required_argument, NULL, 'X'},
+	{"autosave", required_argument, NULL, 'A'},
+	{"live", required_argument, NULL, 'L'},
+	{"sync", required_argument, NULL, 'I'},
+	{"record", required_argument, NULL, 'R'},
+	{"audio", required_argument, NULL, 'a'},
+	{"headless", no_argument, NULL, 'n'},
+	{"time", required_argument, NULL, 't'},
+	{"grid", required_argument, NULL, 'g'},
 	{"step", no_argument, NULL, 's'},
 	{"break", required_argument, NULL, 'b'},
+	{"watch", required_argument, NULL, 'k'},
 	{"memory", no_argument, NULL, 'm'},
+	{"trace", required_argument, NULL, 'w'},
+	{"trace-out", required_argument, NULL, 'W'},
 	{"editor", no_argument, NULL, 'e'},
+	{"heatmap", no_argument, NULL, 'x'},
 	{"cpu", no_argument, NULL, 'c'},
 	{"verbose", no_argument, NULL, 'v'},
 	{"help", no_argument, NULL, 'h'},
@@ -734,6 +1406,17 @@ int main(int argc, char **argv)
 	char rom_path[256] = ROM_PATH;
 	char sprites_path[256] = {0};
 	char save_path[256] = {0};
+	char *grid_save_paths[GRID_MAX_PETS];
+	uint32_t grid_save_num = 0;
+	char compact_path[256] = {0};
+	char diff_path[256] = {0};
+	char convert_format[16] = {0};
+	char store_path[256] = {0};
+	char live_path[256] = {0};
+	char trace_path[256] = {0};
+	uint32_t live_sync_interval = LIVE_SYNC_INTERVAL;
+	char record_path[256] = {0};
+	char wav_path[256] = {0};
 	bool_t gen_header = 0;
 	bool_t extract_sprites = 0;
 	bool_t modify_sprites = 0;
@@ -776,7 +1459,97 @@ int main(int argc, char **argv)
 				break;
 
 			case 'l':
-				strncpy(save_path, optarg, 256);
+				/* The first save is loaded as usual, all of them are
+				 * given to the pets of the grid
+				 */
+				if (grid_save_num >= GRID_MAX_PETS) {
+					hal_log(LOG_ERROR, "FATAL: Too many saves (max %u) !\n", GRID_MAX_PETS);
+					exit(EXIT_FAILURE);
+				}
+
+				if (!grid_save_num) {
+					strncpy(save_path, optarg, 256);
+				}
+
+				grid_save_paths[grid_save_num++] = optarg;
+				break;
+
+			case 'd':
+				state_set_delta(1);
+				break;
+
+			case 'C':
+				strncpy(compact_path, optarg, 256);
+				break;
+
+			case 'S':
+				strncpy(store_path, (optarg != NULL) ? optarg : STORE_PATH, 255);
+				break;
+
+			case 'D':
+				strncpy(diff_path, optarg, 256);
+				break;
+
+			case 'X':
+				strncpy(convert_format, optarg, 15);
+				break;
+
+			case 'A':
+				autosave_interval = (uint64_t) (strtod(optarg, NULL) * 60 * EMU_TICK_FREQUENCY);
+				break;
+
+			case 'L':
+				strncpy(live_path, optarg, 256);
+				break;
+
+			case 'w':
+				if (trace_add_ranges(optarg)) {
+					usage(stderr, argc, argv);
+					exit(EXIT_FAILURE);
+				}
+				memory_hooks_enable = 1;
+				break;
+
+			case 'W':
+				strncpy(trace_path, optarg, 256);
+				break;
+
+			case 'x':
+				heatmap_enable = 1;
+				break;
+
+			case 'k':
+				if (watch_add(optarg)) {
+					usage(stderr, argc, argv);
+					exit(EXIT_FAILURE);
+				}
+				memory_hooks_enable = 1;
+				break;
+
+			case 'I':
+				live_sync_interval = strtoul(optarg, NULL, 0);
+				break;
+
+			case 'R':
+				record_enable = 1;
+				strncpy(record_path, optarg, 256);
+				break;
+
+			case 'a':
+				wav_enable = 1;
+				strncpy(wav_path, optarg, 256);
+				break;
+
+			case 'n':
+				headless_enable = 1;
+				break;
+
+			case 't':
+				emulated_ticks_limit = (uint64_t) (strtod(optarg, NULL) * EMU_TICK_FREQUENCY);
+				break;
+
+			case 'g':
+				grid_num = strtoul(optarg, NULL, 0);
 				break;
 
 			case 's':
@@ -815,6 +1588,39 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (store_path[0] && state_set_store(store_path)) {
+		tamalib_free_bp(&g_breakpoints);
+		return -1;
+	}
+
+	if (compact_path[0]) {
+		/* State file manipulation only (no ROM nor emulation) */
+		tamalib_free_bp(&g_breakpoints);
+		return state_compact(compact_path) ? -1 : 0;
+	}
+
+	if (diff_path[0]) {
+		/* The states to compare are the remaining arguments */
+		tamalib_free_bp(&g_breakpoints);
+		if (optind >= argc) {
+			usage(stderr, argc, argv);
+			exit(EXIT_FAILURE);
+		}
+
+		return diff_states(diff_path, &argv[optind], argc - optind) ? -1 : 0;
+	}
+
+	if (convert_format[0]) {
+		/* The source and destination directories are the remaining arguments */
+		tamalib_free_bp(&g_breakpoints);
+		if (argc - optind != 2) {
+			usage(stderr, argc, argv);
+			exit(EXIT_FAILURE);
+		}
+
+		return convert_states(argv[optind], argv[optind + 1], convert_format) ? -1 : 0;
+	}
+
 	g_program = program_load(rom_path, &g_program_size);
 	if (g_program == NULL) {
 		hal_log(LOG_ERROR, "FATAL: Error while loading ROM %s !\n", rom_path);
@@ -841,7 +1647,26 @@ int main(int argc, char **argv)
 
 	compute_layout();
 
-	if (sdl_init()) {
+	buzzer_init(&buzzer, AUDIO_FREQUENCY);
+	spsc_queue_init(&audio_queue, audio_events, sizeof(buzzer_event_t), AUDIO_QUEUE_SIZE);
+
+	/* Several saves are run side by side */
+	if (!grid_num && grid_save_num > 1) {
+		grid_num = grid_save_num;
+	}
+
+	if (grid_num) {
+		/* The grid has its own loop, and needs a window */
+		headless_enable = 0;
+		record_enable = 0;
+		wav_enable = 0;
+		autosave_interval = 0;
+		live_path[0] = '\0';
+		memory_hooks_enable = 0;
+		memory_editor_enable = 0;
+	}
+
+	if (!headless_enable && sdl_init()) {
 		hal_log(LOG_ERROR, "FATAL: Error while initializing application !\n");
 		SDL_free(g_program);
 		tamalib_free_bp(&g_breakpoints);
@@ -850,23 +1675,101 @@ int main(int argc, char **argv)
 
 	if (tamalib_init(g_program, g_breakpoints, 1000000)) {
 		hal_log(LOG_ERROR, "FATAL: Error while initializing tamalib !\n");
-		sdl_release();
+		if (!headless_enable) {
+			sdl_release();
+		}
 		SDL_free(g_program);
 		tamalib_free_bp(&g_breakpoints);
 		return -1;
 	}
 
+	if (headless_enable) {
+		speed = SPEED_UNLIMITED;
+		tamalib_set_speed((u8_t) speed);
+	}
+
+#ifdef LCD_BULK_UPDATE
+	lcd_set_memory(tamalib_get_state()->memory);
+#endif
+
+	/* A given save takes precedence over the live state */
+	if (live_path[0]) {
+		live_open(live_path, live_sync_interval);
+	}
+
 	if (save_path[0]) {
 		state_load(save_path);
 	}
 
+	sync_memory_shadow();
+
+	last_tick_counter = *(tamalib_get_state()->tick_counter);
+
+	if (record_enable && record_start(record_path)) {
+		record_enable = 0;
+	}
+
+	if (wav_enable && wav_start(wav_path, AUDIO_FREQUENCY, emulated_ticks, buzzer_frequency, buzzer_playing)) {
+		wav_enable = 0;
+	}
+
 	if (memory_editor_enable) {
 		/* Logs are not compatible with the memory editor */
 		log_levels = LOG_ERROR;
 		mem_edit_configure_terminal();
+
+		if (heatmap_enable) {
+			heatmap_start();
+			memory_hooks_enable = 1;
+		}
+	} else {
+		heatmap_enable = 0;
 	}
 
-	tamalib_mainloop();
+	/* Saves are encoded and written by a worker thread, or synchronously
+	 * if it cannot be started
+	 */
+	autosave_start();
+
+	if (grid_num) {
+		if (grid_init(grid_num, grid_save_paths, grid_save_num) || run_grid()) {
+			hal_log(LOG_ERROR, "FATAL: Error while starting the grid !\n");
+		}
+
+		grid_release();
+	} else if (headless_enable) {
+		tamalib_mainloop();
+	} else {
+		/* Rewinding is only available interactively */
+		rewind_enable = 1;
+		rewind_reset();
+
+		if (run_threaded()) {
+			hal_log(LOG_ERROR, "FATAL: Error while starting the emulation !\n");
+		}
+	}
+
+	if (autosave_interval) {
+		autosave_request(emulated_ticks, 1);
+	}
+
+	autosave_stop();
+
+	store_close();
+
+	live_close();
+
+	if (trace_path[0]) {
+		trace_export(trace_path);
+	}
+
+	if (record_enable) {
+		record_stop();
+	}
+
+	if (wav_enable) {
+		wav_stop(emulated_ticks);
+	}
 
 	if (memory_editor_enable) {
 		mem_edit_reset_terminal();
@@ -874,7 +1777,9 @@ int main(int argc, char **argv)
 
 	tamalib_release();
 
-	sdl_release();
+	if (!headless_enable) {
+		sdl_release();
+	}
 
 	SDL_free(g_program);
 
@@ -0,0 +1,174 @@
+/*
+ * TamaTool - A cross-platform Tamagotchi P1 explorer
+ *
+ * Copyright (C) 2021 Jean-Christophe Rona <jc@rona.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "trace.h"
+
+#define TRACE_FILE_MAGIC		"TLTR"
+#define TRACE_FILE_VERSION		1
+#define TRACE_ENTRY_SIZE		10 // Tick, PC, address, old and new values
+
+#define IS_TRACED(addr)			(traced[(addr) >> 5] & (1U << ((addr) & 0x1F)))
+
+/* Traced addresses, one bit each, so that untraced accesses only cost a
+ * bit test
+ */
+static uint32_t traced[MEMORY_SIZE / 32] = {0};
+static bool_t trace_enabled = 0;
+
+static trace_entry_t ring[TRACE_RING_SIZE];
+static uint32_t ring_next = 0;
+static uint32_t ring_num = 0;
+
+static trace_entry_t last_writes[MEMORY_SIZE];
+static bool_t has_last_write[MEMORY_SIZE] = {0};
+
+
+/* Adds a comma separated list of ranges ("0x000-0x27F", a single address,
+ * or "all")
+ */
+bool_t trace_add_ranges(char *ranges)
+{
+	char *end;
+	unsigned long start, stop;
+	uint32_t i;
+
+	while (*ranges != '\0') {
+		if (!strncmp(ranges, "all", 3)) {
+			start = 0;
+			stop = MEMORY_SIZE - 1;
+			end = ranges + 3;
+		} else {
+			start = stop = strtoul(ranges, &end, 0);
+			if (end != ranges && *end == '-') {
+				ranges = end + 1;
+				stop = strtoul(ranges, &end, 0);
+			}
+
+			if (end == ranges || start > stop || stop >= MEMORY_SIZE) {
+				fprintf(stderr, "FATAL: Invalid address range \"%s\" !\n", ranges);
+				return 1;
+			}
+		}
+
+		if (*end != ',' && *end != '\0') {
+			fprintf(stderr, "FATAL: Invalid address range \"%s\" !\n", ranges);
+			return 1;
+		}
+
+		for (i = start; i <= stop; i++) {
+			traced[i >> 5] |= 1U << (i & 0x1F);
+		}
+
+		trace_enabled = 1;
+		ranges = (*end == ',') ? end + 1 : end;
+	}
+
+	return 0;
+}
+
+bool_t trace_is_enabled(void)
+{
+	return trace_enabled;
+}
+
+void trace_write(u32_t tick, u13_t pc, u12_t addr, u4_t old_value, u4_t value)
+{
+	trace_entry_t *entry;
+
+	if (!IS_TRACED(addr)) {
+		return;
+	}
+
+	entry = &ring[ring_next];
+	*entry = (trace_entry_t) { tick, pc, addr, old_value, value };
+
+	ring_next = (ring_next + 1) % TRACE_RING_SIZE;
+	if (ring_num < TRACE_RING_SIZE) {
+		ring_num++;
+	}
+
+	last_writes[addr] = *entry;
+	has_last_write[addr] = 1;
+}
+
+/* Returns 1 if no write to addr has been traced */
+bool_t trace_last_write(u12_t addr, trace_entry_t *entry)
+{
+	if (addr >= MEMORY_SIZE || !has_last_write[addr]) {
+		return 1;
+	}
+
+	*entry = last_writes[addr];
+
+	return 0;
+}
+
+/* Writes the history, from the oldest write to the latest one */
+bool_t trace_export(char *path)
+{
+	FILE *fp;
+	uint8_t data[TRACE_ENTRY_SIZE];
+	uint8_t header[12];
+	trace_entry_t *entry;
+	uint32_t i;
+
+	fp = fopen(path, "wb");
+	if (fp == NULL) {
+		fprintf(stderr, "FATAL: Cannot create file \"%s\" !\n", path);
+		return 1;
+	}
+
+	memcpy(header, TRACE_FILE_MAGIC, 4);
+	header[4] = TRACE_FILE_VERSION;
+	header[5] = TRACE_ENTRY_SIZE;
+	header[6] = header[7] = 0;
+	header[8] = ring_num & 0xFF;
+	header[9] = (ring_num >> 8) & 0xFF;
+	header[10] = (ring_num >> 16) & 0xFF;
+	header[11] = ring_num >> 24;
+	fwrite(header, sizeof(header), 1, fp);
+
+	for (i = 0; i < ring_num; i++) {
+		entry = &ring[(ring_next + TRACE_RING_SIZE - ring_num + i) % TRACE_RING_SIZE];
+
+		data[0] = entry->tick & 0xFF;
+		data[1] = (entry->tick >> 8) & 0xFF;
+		data[2] = (entry->tick >> 16) & 0xFF;
+		data[3] = entry->tick >> 24;
+		data[4] = entry->pc & 0xFF;
+		data[5] = entry->pc >> 8;
+		data[6] = entry->addr & 0xFF;
+		data[7] = entry->addr >> 8;
+		data[8] = entry->old_value;
+		data[9] = entry->new_value;
+		fwrite(data, sizeof(data), 1, fp);
+	}
+
+	if (fclose(fp) != 0) {
+		fprintf(stderr, "FATAL: Failed to write to file \"%s\" !\n", path);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,42 @@
+/*
+ * TamaTool - A cross-platform Tamagotchi P1 explorer
+ *
+ * Copyright (C) 2021 Jean-Christophe Rona <jc@rona.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include "lib/tamalib.h"
+
+#define TRACE_RING_SIZE			65536 // Writes kept in the history
+
+typedef struct {
+	u32_t tick;
+	u13_t pc;
+	u12_t addr;
+	u4_t old_value;
+	u4_t new_value;
+} trace_entry_t;
+
+
+bool_t trace_add_ranges(char *ranges);
+bool_t trace_is_enabled(void);
+void trace_write(u32_t tick, u13_t pc, u12_t addr, u4_t old_value, u4_t value);
+bool_t trace_last_write(u12_t addr, trace_entry_t *entry);
+bool_t trace_export(char *path);
+
+#endif /* _TRACE_H_ */
@@ -0,0 +1,156 @@
+/*
+ * TamaTool - A cross-platform Tamagotchi P1 explorer
+ *
+ * Copyright (C) 2021 Jean-Christophe Rona <jc@rona.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "watch.h"
+
+#define IS_SET(bitmap, addr)		((bitmap)[(addr) >> 5] & (1U << ((addr) & 0x1F)))
+
+static watchpoint_t watchpoints[WATCH_MAX_NUM];
+static uint32_t watch_num = 0;
+
+/* Watched addresses, one bit each, so that unwatched accesses only cost a
+ * bit test. The watchpoints are only looked at on a hit.
+ */
+static uint32_t read_watched[MEMORY_SIZE / 32] = {0};
+static uint32_t write_watched[MEMORY_SIZE / 32] = {0};
+
+
+/* Parses "<addr>[-<addr>][:r|:w|:c|:=<value>]", a write watchpoint being
+ * the default
+ */
+bool_t watch_add(char *spec)
+{
+	watchpoint_t *wp;
+	uint32_t *bitmap;
+	unsigned long start, end, value = 0;
+	char *next;
+	watch_type_t type = WATCH_WRITE;
+	uint32_t i;
+
+	if (watch_num >= WATCH_MAX_NUM) {
+		fprintf(stderr, "FATAL: Too many watchpoints (max %u) !\n", WATCH_MAX_NUM);
+		return 1;
+	}
+
+	start = end = strtoul(spec, &next, 0);
+	if (next != spec && *next == '-') {
+		end = strtoul(next + 1, &next, 0);
+	}
+
+	if (next == spec || start > end || end >= MEMORY_SIZE) {
+		fprintf(stderr, "FATAL: Invalid watchpoint address in \"%s\" !\n", spec);
+		return 1;
+	}
+
+	if (*next == ':') {
+		next++;
+		switch (*next) {
+			case 'r':
+				type = WATCH_READ;
+				next++;
+				break;
+
+			case 'w':
+				type = WATCH_WRITE;
+				next++;
+				break;
+
+			case 'c':
+				type = WATCH_CHANGE;
+				next++;
+				break;
+
+			case '=':
+				type = WATCH_EQUAL;
+				value = strtoul(next + 1, &next, 0);
+				break;
+
+			default:
+				break;
+		}
+	}
+
+	if (*next != '\0' || value > 0xF) {
+		fprintf(stderr, "FATAL: Invalid watchpoint condition in \"%s\" !\n", spec);
+		return 1;
+	}
+
+	wp = &watchpoints[watch_num++];
+	*wp = (watchpoint_t) { type, start, end, value };
+
+	bitmap = (type == WATCH_READ) ? read_watched : write_watched;
+	for (i = start; i <= end; i++) {
+		bitmap[i >> 5] |= 1U << (i & 0x1F);
+	}
+
+	return 0;
+}
+
+bool_t watch_is_enabled(void)
+{
+	return watch_num > 0;
+}
+
+/* Returns the watchpoint hit by the access, if any */
+watchpoint_t * watch_read(u12_t addr)
+{
+	uint32_t i;
+
+	if (!IS_SET(read_watched, addr)) {
+		return NULL;
+	}
+
+	for (i = 0; i < watch_num; i++) {
+		if (watchpoints[i].type == WATCH_READ && addr >= watchpoints[i].start && addr <= watchpoints[i].end) {
+			return &watchpoints[i];
+		}
+	}
+
+	return NULL;
+}
+
+watchpoint_t * watch_write(u12_t addr, u4_t old_value, u4_t value)
+{
+	watchpoint_t *wp;
+	uint32_t i;
+
+	if (!IS_SET(write_watched, addr)) {
+		return NULL;
+	}
+
+	for (i = 0; i < watch_num; i++) {
+		wp = &watchpoints[i];
+		if (addr < wp->start || addr > wp->end) {
+			continue;
+		}
+
+		if (wp->type == WATCH_WRITE ||
+			(wp->type == WATCH_CHANGE && value != old_value) ||
+			(wp->type == WATCH_EQUAL && value == wp->value)) {
+			return wp;
+		}
+	}
+
+	return NULL;
+}
@@ -0,0 +1,47 @@
+/*
+ * TamaTool - A cross-platform Tamagotchi P1 explorer
+ *
+ * Copyright (C) 2021 Jean-Christophe Rona <jc@rona.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#ifndef _WATCH_H_
+#define _WATCH_H_
+
+#include "lib/tamalib.h"
+
+#define WATCH_MAX_NUM			32
+
+typedef enum {
+	WATCH_READ,
+	WATCH_WRITE,
+	WATCH_CHANGE, // Write of a different value
+	WATCH_EQUAL, // Write of the given value
+} watch_type_t;
+
+typedef struct {
+	watch_type_t type;
+	u12_t start;
+	u12_t end;
+	u4_t value;
+} watchpoint_t;
+
+
+bool_t watch_add(char *spec);
+bool_t watch_is_enabled(void);
+watchpoint_t * watch_read(u12_t addr);
+watchpoint_t * watch_write(u12_t addr, u4_t old_value, u4_t value);
+
+#endif /* _WATCH_H_ */
@@ -0,0 +1,158 @@
+/*
+ * TamaTool - A cross-platform Tamagotchi P1 explorer
+ *
+ * Copyright (C) 2021 Jean-Christophe Rona <jc@rona.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "SDL.h"
+
+#include "wav.h"
+#include "state.h"
+
+#define WAV_VOLUME			0.5f
+#define WAV_CHUNK_SAMPLES		1024
+#define WAV_HEADER_SIZE			44
+
+static FILE *wav_fp = NULL;
+static char wav_path[256];
+static buzzer_t wav_buzzer;
+
+static uint64_t start_ticks;
+static uint64_t rendered_samples;
+
+
+static void write_u16(uint8_t *buf, uint16_t v)
+{
+	buf[0] = v & 0xFF;
+	buf[1] = (v >> 8) & 0xFF;
+}
+
+static void write_u32(uint8_t *buf, uint32_t v)
+{
+	write_u16(buf, v & 0xFFFF);
+	write_u16(buf + 2, v >> 16);
+}
+
+/* 16-bit mono PCM, the sizes are patched once the recording stops */
+static void write_header(uint32_t data_size)
+{
+	uint8_t header[WAV_HEADER_SIZE];
+
+	memcpy(header, "RIFF", 4);
+	write_u32(header + 4, WAV_HEADER_SIZE - 8 + data_size);
+	memcpy(header + 8, "WAVEfmt ", 8);
+	write_u32(header + 16, 16);
+	write_u16(header + 20, 1); // PCM
+	write_u16(header + 22, 1); // Mono
+	write_u32(header + 24, wav_buzzer.sample_rate);
+	write_u32(header + 28, wav_buzzer.sample_rate * 2);
+	write_u16(header + 32, 2);
+	write_u16(header + 34, 16);
+	memcpy(header + 36, "data", 4);
+	write_u32(header + 40, data_size);
+
+	fwrite(header, 1, WAV_HEADER_SIZE, wav_fp);
+}
+
+/* Renders the buzzer up to the given emulated time, with the current settings */
+static void render_until(uint64_t ticks)
+{
+	float samples[WAV_CHUNK_SAMPLES];
+	uint8_t pcm[WAV_CHUNK_SAMPLES * 2];
+	uint64_t target;
+	uint32_t num, i;
+
+	if (ticks < start_ticks) {
+		return;
+	}
+
+	target = ((ticks - start_ticks) * wav_buzzer.sample_rate) / EMU_TICK_FREQUENCY;
+
+	while (rendered_samples < target) {
+		num = (target - rendered_samples > WAV_CHUNK_SAMPLES) ? WAV_CHUNK_SAMPLES : (uint32_t) (target - rendered_samples);
+
+		buzzer_fill(&wav_buzzer, samples, num, WAV_VOLUME);
+
+		for (i = 0; i < num; i++) {
+			write_u16(pcm + i * 2, (uint16_t) (int16_t) (samples[i] * 32767.0f));
+		}
+
+		fwrite(pcm, 2, num, wav_fp);
+		rendered_samples += num;
+	}
+}
+
+/* The buzzer starts with the given settings, since a restored state does
+ * not trigger any change once the recording has started
+ */
+bool_t wav_start(char *path, uint32_t sample_rate, uint64_t ticks, u32_t freq, bool_t en)
+{
+	wav_fp = fopen(path, "wb");
+	if (!wav_fp) {
+		fprintf(stderr, "FATAL: Cannot create audio file \"%s\" !\n", path);
+		return 1;
+	}
+
+	strncpy(wav_path, path, sizeof(wav_path) - 1);
+	wav_path[sizeof(wav_path) - 1] = '\0';
+
+	buzzer_init(&wav_buzzer, sample_rate);
+	buzzer_set_frequency(&wav_buzzer, freq);
+	buzzer_play(&wav_buzzer, en);
+	start_ticks = ticks;
+	rendered_samples = 0;
+
+	write_header(0);
+
+	return 0;
+}
+
+/* Called with every buzzer change and its emulated time (in ticks), which
+ * makes the output independent of the emulation speed
+ */
+void wav_event(uint64_t ticks, const buzzer_event_t *ev)
+{
+	if (wav_fp == NULL) {
+		return;
+	}
+
+	render_until(ticks);
+	buzzer_apply(&wav_buzzer, ev);
+}
+
+void wav_stop(uint64_t ticks)
+{
+	if (wav_fp == NULL) {
+		return;
+	}
+
+	render_until(ticks);
+
+	if (rendered_samples * 2 > UINT32_MAX - WAV_HEADER_SIZE) {
+		fprintf(stderr, "FATAL: Audio file \"%s\" is too long !\n", wav_path);
+	}
+
+	fseek(wav_fp, 0, SEEK_SET);
+	write_header((uint32_t) (rendered_samples * 2));
+
+	fclose(wav_fp);
+	wav_fp = NULL;
+}